@@ -1,11 +1,31 @@
+/********************************************************************************
+ Compile:
+ *      GCC:    cc -O2 cpick.c -lX11 -lXext -lXrandr -lXinerama -lm -pthread -o cpick
+********************************************************************************/
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
 #include <X11/cursorfont.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xinerama.h>
+
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif // __SSE2__
 
 #define PROJECT_NAME "cpick"
 #define PROJECT_VERSION "Version: 0.1"
@@ -16,8 +36,29 @@ const char *help_message = "Timer and Stopwatch writtern in C.\n\n"
 "\n"
 "   For Hex color: Left Click\n"
 "   For RGB color: Right Click\n"
+"   For palette:   Drag with Left Click, when started with --palette\n"
+"\n"
+"   In a session every click adds a color, u or BackSpace removes the last\n"
+"   one, Enter, q or Escape ends the session and prints all colors.\n"
 "Options:\n"
 "   -n --no-fullscreen      Don't start fullscreen\n"
+"   -s --no-shm             Capture through the X connection instead of shared memory\n"
+"   -w --whole-screen       Capture every monitor instead of the one under the pointer\n"
+"   -z --zoom               Size of the magnifier grid in pixels, 0 disables it\n"
+"                           (default: 15)\n"
+"   -a --area               Size of the sampled area in pixels, changed with the\n"
+"                           scroll wheel (default: 1)\n"
+"   -m --mode               How the sampled area is combined: mean, gauss, median\n"
+"                           (default: mean)\n"
+"   -p --palette            Print given number of dominant colors of the dragged\n"
+"                           rectangle, or of the whole screen on a click\n"
+"   -f --file               Extract the palette from a PPM/PGM file without X\n"
+"   -t --threads            Threads used for the palette (default: all cores)\n"
+"   -c --collect            Pick many colors from one capture in a session\n"
+"   -o --output             Output format of a session: hex, rgb, json (default: hex)\n"
+"   -e --stream             Print every pick of a session as it happens, as one\n"
+"                           line each, instead of all at the end. Undoing a pick\n"
+"                           prints `undo`, or {\"undo\": pick} with json\n"
 "   -h --help               Print help\n"
 "   -v --version            Print version\n\n"
 PROJECT_VERSION
@@ -34,27 +75,161 @@ typedef enum {
 
 typedef struct {
     Mouse_Buttons button;
+    int released;
+    int moved;
     int x;
     int y;
 } Mouse_State;
 Mouse_State Mouse;
 
+typedef struct {
+    KeySym key;
+} Keyboard_State;
+Keyboard_State Keyboard;
+
+#define MAX_DAMAGE_RECTS 32
+
+// Window areas which need to be repainted from the backing pixmap.
+typedef struct {
+    XRectangle rects[MAX_DAMAGE_RECTS];
+    int count;
+} Damage_State;
+Damage_State Damage;
+
+typedef struct {
+    unsigned long mask;
+    int shift;
+    int bits;
+} Channel_Format;
+
+// Describes how pixel values of the visual map to RGB, so pixels are decoded
+// locally instead of asking the server with XQueryColor.
+typedef struct {
+    Channel_Format red;
+    Channel_Format green;
+    Channel_Format blue;
+    int true_color;
+    Colormap colormap;
+    int map_entries;
+    XColor *cache;
+} Pixel_Format;
+
 typedef struct {
     Display *display;
     Window window;
     Window root_window;
+    Visual *visual;
+    int depth;
+    int shm;
+    Pixel_Format format;
     Atom delete_window;
     GC gc;
     Cursor cursor;
+    Pixmap backing;
+    int screen_x;
+    int screen_y;
     int screen_width;
     int screen_height;
 } Window_State;
 
-typedef XImage Image;
+typedef struct {
+    XImage *ximage;
+    XShmSegmentInfo shm_info;
+    int shm;
+    int width;
+    int height;
+} Image;
 typedef XColor Color;
 
 static int WindowShouldClose = 0;
 static int FullScreen = 1;
+static int UseShm = 1;
+static int WholeScreen = 0;
+static int ZoomSize = 15;
+
+#define MAX_SAMPLE_SIZE 64
+
+typedef enum {
+    SAMPLE_MEAN,
+    SAMPLE_GAUSS,
+    SAMPLE_MEDIAN,
+    SAMPLE_MODE_COUNT
+} Sample_Mode;
+
+static const char *Sample_Mode_Names[SAMPLE_MODE_COUNT] = {
+    "mean", "gauss", "median"
+};
+
+static Sample_Mode SampleMode = SAMPLE_MEAN;
+static int SampleSize = 1;
+
+#define MAX_PALETTE_SIZE 64
+
+static int PaletteSize = 0;
+static int PaletteThreads = 0;
+static const char *PaletteFile = NULL;
+
+typedef enum {
+    OUTPUT_HEX,
+    OUTPUT_RGB,
+    OUTPUT_JSON,
+    OUTPUT_FORMAT_COUNT
+} Output_Format;
+
+static const char *Output_Format_Names[OUTPUT_FORMAT_COUNT] = {
+    "hex", "rgb", "json"
+};
+
+static int Collect = 0;
+static int Stream = 0;
+static Output_Format OutputFormat = OUTPUT_HEX;
+
+typedef struct {
+    Color color;
+    int x;
+    int y;
+} Pick;
+
+// Colors picked in a session, kept until the session ends.
+typedef struct {
+    Pick *items;
+    int count;
+    int capacity;
+} Pick_List;
+Pick_List Picks;
+
+// Rectangle dragged out for the palette, from the press to the cursor.
+typedef struct {
+    int active;
+    int shown;
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} Selection_State;
+Selection_State Selection;
+
+#define LOUPE_SCALE 8
+#define LOUPE_OFFSET 24
+#define LOUPE_LABEL_HEIGHT 18
+// The frame around the picked pixel reaches this far out of the loupe.
+#define LOUPE_BORDER 1
+
+// Magnifier which follows the cursor. `zoomed` holds the pixels under the
+// cursor, at `region_x`, `region_y`, enlarged LOUPE_SCALE times.
+typedef struct {
+    Image *zoomed;
+    int size;
+    int region_x;
+    int region_y;
+    int x;
+    int y;
+    int width;
+    int height;
+    int shown;
+    int dirty;
+} Loupe_State;
+Loupe_State Loupe;
 
 void cli_init(int argc, char *argv[]) {
     for (int i = 1; i < argc; i++) {
@@ -67,11 +242,276 @@ void cli_init(int argc, char *argv[]) {
             exit(1);
         } else if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--no-fullscreen") == 0) {
             FullScreen = 0;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--no-shm") == 0) {
+            UseShm = 0;
+        } else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--whole-screen") == 0) {
+            WholeScreen = 1;
+        } else if (strcmp(argv[i], "-z") == 0 || strcmp(argv[i], "--zoom") == 0) {
+            if (argv[i+1] == NULL) {
+                fprintf(
+                    stderr, "Error: `%s` requires integer value. No value is given.\n\n%s",
+                    argv[i], help_message
+                );
+                exit(1);
+            }
+
+            ZoomSize = atoi(argv[i+1]);
+            if (ZoomSize < 0 || ZoomSize > 64 || (ZoomSize == 0 && strcmp(argv[i+1], "0") != 0)) {
+                fprintf(
+                    stderr, "Error: `%s` only supports values from 0 to 64. Given value: %s\n\n%s",
+                    argv[i], argv[i+1], help_message
+                );
+                exit(1);
+            }
+
+            i++;
+        } else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--area") == 0) {
+            if (argv[i+1] == NULL) {
+                fprintf(
+                    stderr, "Error: `%s` requires integer value. No value is given.\n\n%s",
+                    argv[i], help_message
+                );
+                exit(1);
+            }
+
+            SampleSize = atoi(argv[i+1]);
+            if (SampleSize < 1 || SampleSize > MAX_SAMPLE_SIZE) {
+                fprintf(
+                    stderr, "Error: `%s` only supports values from 1 to %d. Given value: %s\n\n%s",
+                    argv[i], MAX_SAMPLE_SIZE, argv[i+1], help_message
+                );
+                exit(1);
+            }
+
+            i++;
+        } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mode") == 0) {
+            if (argv[i+1] == NULL) {
+                fprintf(
+                    stderr, "Error: `%s` requires a value. No value is given.\n\n%s",
+                    argv[i], help_message
+                );
+                exit(1);
+            }
+
+            int mode = 0;
+            while (mode < SAMPLE_MODE_COUNT && strcmp(argv[i+1], Sample_Mode_Names[mode]) != 0) mode++;
+            if (mode == SAMPLE_MODE_COUNT) {
+                fprintf(
+                    stderr, "Error: `%s` only supports mean, gauss or median. Given value: %s\n\n%s",
+                    argv[i], argv[i+1], help_message
+                );
+                exit(1);
+            }
+            SampleMode = mode;
+
+            i++;
+        } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--palette") == 0) {
+            if (argv[i+1] == NULL) {
+                fprintf(
+                    stderr, "Error: `%s` requires integer value. No value is given.\n\n%s",
+                    argv[i], help_message
+                );
+                exit(1);
+            }
+
+            PaletteSize = atoi(argv[i+1]);
+            if (PaletteSize < 1 || PaletteSize > MAX_PALETTE_SIZE) {
+                fprintf(
+                    stderr, "Error: `%s` only supports values from 1 to %d. Given value: %s\n\n%s",
+                    argv[i], MAX_PALETTE_SIZE, argv[i+1], help_message
+                );
+                exit(1);
+            }
+
+            i++;
+        } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--file") == 0) {
+            if (argv[i+1] == NULL) {
+                fprintf(
+                    stderr, "Error: `%s` requires a file. No value is given.\n\n%s",
+                    argv[i], help_message
+                );
+                exit(1);
+            }
+
+            PaletteFile = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) {
+            if (argv[i+1] == NULL) {
+                fprintf(
+                    stderr, "Error: `%s` requires integer value. No value is given.\n\n%s",
+                    argv[i], help_message
+                );
+                exit(1);
+            }
+
+            PaletteThreads = atoi(argv[i+1]);
+            if (PaletteThreads < 1) {
+                fprintf(
+                    stderr, "Error: `%s` only supports positive integer values. Given value: %s\n\n%s",
+                    argv[i], argv[i+1], help_message
+                );
+                exit(1);
+            }
+
+            i++;
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--collect") == 0) {
+            Collect = 1;
+        } else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--stream") == 0) {
+            Stream = 1;
+        } else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
+            if (argv[i+1] == NULL) {
+                fprintf(
+                    stderr, "Error: `%s` requires a value. No value is given.\n\n%s",
+                    argv[i], help_message
+                );
+                exit(1);
+            }
+
+            int format = 0;
+            while (format < OUTPUT_FORMAT_COUNT && strcmp(argv[i+1], Output_Format_Names[format]) != 0) format++;
+            if (format == OUTPUT_FORMAT_COUNT) {
+                fprintf(
+                    stderr, "Error: `%s` only supports hex, rgb or json. Given value: %s\n\n%s",
+                    argv[i], argv[i+1], help_message
+                );
+                exit(1);
+            }
+            OutputFormat = format;
+
+            i++;
         } else if (argv[i][0] == '-') {
             fprintf(stderr, "Error: wrong argument provided `%s`\n\n%s", argv[i], help_message);
             exit(1);
         }
     }
+
+    if (Collect && PaletteSize) {
+        fprintf(stderr, "Error: `--collect` can't be used with `--palette`.\n\n%s", help_message);
+        exit(1);
+    }
+}
+
+Channel_Format channel_format(unsigned long mask) {
+    Channel_Format channel = { .mask = mask };
+    if (!mask) return channel;
+
+    while (!((mask >> channel.shift) & 1)) channel.shift++;
+    while ((mask >> (channel.shift + channel.bits)) & 1) channel.bits++;
+    return channel;
+}
+
+void init_pixel_format(Window_State *state, int screen) {
+    Pixel_Format *format = &state->format;
+    XVisualInfo template = { .visualid = XVisualIDFromVisual(state->visual) };
+    int count = 0;
+    XVisualInfo *info = XGetVisualInfo(state->display, VisualIDMask, &template, &count);
+    if (!info) {
+        fprintf(stderr, "Couldn't get visual info.\n");
+        exit(1);
+    }
+
+    format->true_color = info->class == TrueColor || info->class == DirectColor;
+    format->red = channel_format(info->red_mask);
+    format->green = channel_format(info->green_mask);
+    format->blue = channel_format(info->blue_mask);
+    format->colormap = DefaultColormap(state->display, screen);
+    format->map_entries = info->colormap_size;
+    XFree(info);
+}
+
+unsigned short decode_channel(const Channel_Format *channel, unsigned long pixel) {
+    unsigned long value = (pixel & channel->mask) >> channel->shift;
+    if (channel->bits >= 8) return value >> (channel->bits - 8);
+    if (channel->bits == 0) return 0;
+    return value * 255 / ((1UL << channel->bits) - 1);
+}
+
+// Decodes `pixel` into 8 bit channels. Colormapped visuals read the whole
+// colormap with a single request on first use and decode from that cache.
+Color decode_pixel(Window_State *state, unsigned long pixel) {
+    Pixel_Format *format = &state->format;
+    Color color = { .pixel = pixel };
+
+    if (format->true_color) {
+        color.red = decode_channel(&format->red, pixel);
+        color.green = decode_channel(&format->green, pixel);
+        color.blue = decode_channel(&format->blue, pixel);
+        return color;
+    }
+
+    if (!format->cache) {
+        format->cache = malloc(format->map_entries * sizeof(XColor));
+        if (!format->cache) {
+            fprintf(stderr, "Couldn't allocate colormap cache.\n");
+            exit(1);
+        }
+        for (int i = 0; i < format->map_entries; i++) format->cache[i].pixel = i;
+        XQueryColors(state->display, format->colormap, format->cache, format->map_entries);
+    }
+
+    if (pixel < (unsigned long)format->map_entries) {
+        color.red = format->cache[pixel].red >> 8;
+        color.green = format->cache[pixel].green >> 8;
+        color.blue = format->cache[pixel].blue >> 8;
+    }
+    return color;
+}
+
+// Sets the captured area to the monitor under the pointer, found with RandR
+// 1.5 monitors or Xinerama, so memory and capture time are bounded by one
+// monitor instead of the whole virtual screen.
+void find_monitor(Window_State *state, int screen) {
+    state->screen_x = 0;
+    state->screen_y = 0;
+    state->screen_width = DisplayWidth(state->display, screen);
+    state->screen_height = DisplayHeight(state->display, screen);
+    if (WholeScreen) return;
+
+    Window root, child;
+    int x, y, window_x, window_y;
+    unsigned int mask;
+    if (!XQueryPointer(
+        state->display, state->root_window, &root, &child,
+        &x, &y, &window_x, &window_y, &mask
+    )) return;
+
+    int event_base, error_base, major = 0, minor = 0;
+    if (
+        XRRQueryExtension(state->display, &event_base, &error_base) &&
+        XRRQueryVersion(state->display, &major, &minor) &&
+        (major > 1 || (major == 1 && minor >= 5))
+    ) {
+        int count = 0;
+        XRRMonitorInfo *monitors = XRRGetMonitors(state->display, state->root_window, 1, &count);
+        for (int i = 0; i < count; i++) {
+            XRRMonitorInfo *m = &monitors[i];
+            if (x >= m->x && x < m->x + m->width && y >= m->y && y < m->y + m->height) {
+                state->screen_x = m->x;
+                state->screen_y = m->y;
+                state->screen_width = m->width;
+                state->screen_height = m->height;
+                break;
+            }
+        }
+        if (monitors) XRRFreeMonitors(monitors);
+        if (count > 0) return;
+    }
+
+    if (XineramaIsActive(state->display)) {
+        int count = 0;
+        XineramaScreenInfo *screens = XineramaQueryScreens(state->display, &count);
+        for (int i = 0; i < count; i++) {
+            XineramaScreenInfo *s = &screens[i];
+            if (x >= s->x_org && x < s->x_org + s->width && y >= s->y_org && y < s->y_org + s->height) {
+                state->screen_x = s->x_org;
+                state->screen_y = s->y_org;
+                state->screen_width = s->width;
+                state->screen_height = s->height;
+                break;
+            }
+        }
+        if (screens) XFree(screens);
+    }
 }
 
 void init_window(
@@ -86,9 +526,14 @@ void init_window(
     int screen = DefaultScreen(state->display);
 
     state->root_window = RootWindow(state->display, screen);
+    state->visual = DefaultVisual(state->display, screen);
+    state->depth = DefaultDepth(state->display, screen);
+    state->shm = UseShm && XShmQueryExtension(state->display);
+    init_pixel_format(state, screen);
+    find_monitor(state, screen);
     state->window = XCreateSimpleWindow(
         state->display, state->root_window,
-        0, 0,
+        state->screen_x, state->screen_y,
         window_width, window_height,
         0, 0,
         BlackPixel(state->display, screen)
@@ -101,7 +546,8 @@ void init_window(
 
     XSelectInput(
         state->display, state->window,
-        ExposureMask | KeyPressMask | ButtonPressMask
+        ExposureMask | KeyPressMask | ButtonPressMask | ButtonReleaseMask |
+        PointerMotionMask
     );
     XStoreName(state->display, state->window, desc);
     XMapWindow(state->display, state->window);
@@ -118,9 +564,11 @@ void init_window(
 
     state->gc = XCreateGC(state->display, state->window, 0, 0);
     XSetForeground(state->display, state->gc, WhitePixel(state->display, screen));
+    XSetGraphicsExposures(state->display, state->gc, 0);
 
-    state->screen_width = DisplayWidth(state->display, screen);
-    state->screen_height = DisplayHeight(state->display, screen);
+    // Everything is painted from the backing pixmap, so don't let the server
+    // clear exposed areas to black first.
+    XSetWindowBackgroundPixmap(state->display, state->window, None);
 }
 
 void fullscreen_window(Window_State *state) {
@@ -140,35 +588,204 @@ void set_plus_cursor(Window_State *state) {
     XDefineCursor(state->display, state->window, state->cursor);
 }
 
-Image *get_screen_img(Window_State *state) {
-    return XGetImage(
-        state->display, state->root_window,
-        0, 0,
-        state->screen_width, state->screen_height,
-        AllPlanes, ZPixmap
+static int Shm_Error = 0;
+
+static int shm_error_handler(Display *display, XErrorEvent *event) {
+    (void)display;
+    (void)event;
+    Shm_Error = 1;
+    return 0;
+}
+
+// Puts the image buffer into a shared memory segment which the server
+// writes into directly. Fails on remote displays, where the caller falls
+// back to reading the image through the X connection.
+int create_shm_img(Window_State *state, Image *img) {
+    img->ximage = XShmCreateImage(
+        state->display, state->visual, state->depth, ZPixmap,
+        NULL, &img->shm_info, img->width, img->height
+    );
+    if (!img->ximage) return 0;
+
+    img->shm_info.shmid = shmget(
+        IPC_PRIVATE, img->ximage->bytes_per_line * img->ximage->height,
+        IPC_CREAT | 0600
     );
+    if (img->shm_info.shmid < 0) {
+        XDestroyImage(img->ximage);
+        return 0;
+    }
+
+    img->shm_info.shmaddr = img->ximage->data = shmat(img->shm_info.shmid, NULL, 0);
+    img->shm_info.readOnly = 0;
+    if (img->shm_info.shmaddr == (char *)-1) {
+        shmctl(img->shm_info.shmid, IPC_RMID, NULL);
+        img->ximage->data = NULL;
+        XDestroyImage(img->ximage);
+        return 0;
+    }
+
+    Shm_Error = 0;
+    XErrorHandler old_handler = XSetErrorHandler(shm_error_handler);
+    XShmAttach(state->display, &img->shm_info);
+    XSync(state->display, 0);
+    XSetErrorHandler(old_handler);
+
+    // The segment is freed once both sides have detached from it.
+    shmctl(img->shm_info.shmid, IPC_RMID, NULL);
+
+    if (Shm_Error) {
+        shmdt(img->shm_info.shmaddr);
+        img->ximage->data = NULL;
+        XDestroyImage(img->ximage);
+        return 0;
+    }
+
+    img->shm = 1;
+    return 1;
 }
 
-void put_img(
-    Window_State *state, Image *img,
-    int x, int y, int width, int height
-) {
-    XPutImage(
+Image *create_img(Window_State *state, int width, int height) {
+    Image *img = calloc(1, sizeof(Image));
+    if (!img) {
+        fprintf(stderr, "Couldn't allocate image.\n");
+        exit(1);
+    }
+    img->width = width;
+    img->height = height;
+
+    if (state->shm && create_shm_img(state, img)) return img;
+    state->shm = 0;
+
+    img->ximage = XCreateImage(
+        state->display, state->visual, state->depth, ZPixmap,
+        0, NULL, width, height, 32, 0
+    );
+    if (!img->ximage) {
+        fprintf(stderr, "Couldn't create image.\n");
+        exit(1);
+    }
+    img->ximage->data = malloc(img->ximage->bytes_per_line * height);
+    if (!img->ximage->data) {
+        fprintf(stderr, "Couldn't allocate image.\n");
+        exit(1);
+    }
+
+    return img;
+}
+
+// Copies the area at `x`, `y` of `src` into `img`.
+void capture_img(Window_State *state, Image *img, Drawable src, int x, int y) {
+    if (img->shm) {
+        XShmGetImage(state->display, src, img->ximage, x, y, AllPlanes);
+    } else {
+        XGetSubImage(
+            state->display, src,
+            x, y,
+            img->width, img->height,
+            AllPlanes, ZPixmap,
+            img->ximage, 0, 0
+        );
+    }
+}
+
+Image *get_screen_img(Window_State *state) {
+    Image *img = create_img(state, state->screen_width, state->screen_height);
+    capture_img(state, img, state->root_window, state->screen_x, state->screen_y);
+    return img;
+}
+
+void put_img(Window_State *state, Image *img, Drawable dst, int x, int y) {
+    if (img->shm) {
+        XShmPutImage(
+            state->display, dst,
+            state->gc, img->ximage,
+            0, 0,
+            x, y,
+            img->width, img->height,
+            0
+        );
+    } else {
+        XPutImage(
+            state->display, dst,
+            state->gc, img->ximage,
+            0, 0,
+            x, y,
+            img->width, img->height
+        );
+    }
+}
+
+// Uploads `img` once into a server-side pixmap, after that the window is
+// repainted with XCopyArea without sending any pixels.
+void upload_img(Window_State *state, Image *img) {
+    state->backing = XCreatePixmap(
         state->display, state->window,
-        state->gc, img,
-        0, 0,
-        x, y,
-        width, height
+        img->width, img->height, state->depth
     );
+    put_img(state, img, state->backing, 0, 0);
 }
 
-void free_image(Image *img) {
-    XDestroyImage(img);
+void damage_add(int x, int y, int width, int height) {
+    if (Damage.count == MAX_DAMAGE_RECTS) {
+        // Out of room, merge everything into one bounding rectangle.
+        int x1 = x, y1 = y, x2 = x + width, y2 = y + height;
+        for (int i = 0; i < Damage.count; i++) {
+            XRectangle *r = &Damage.rects[i];
+            if (r->x < x1) x1 = r->x;
+            if (r->y < y1) y1 = r->y;
+            if (r->x + r->width > x2) x2 = r->x + r->width;
+            if (r->y + r->height > y2) y2 = r->y + r->height;
+        }
+        Damage.count = 0;
+        x = x1; y = y1; width = x2 - x1; height = y2 - y1;
+    }
+
+    XRectangle *r = &Damage.rects[Damage.count++];
+    r->x = x;
+    r->y = y;
+    r->width = width;
+    r->height = height;
+}
+
+// Repaints the damaged areas from the backing pixmap, returns the number of
+// repainted areas.
+int end_drawing(Window_State *state) {
+    int count = Damage.count;
+
+    for (int i = 0; i < Damage.count; i++) {
+        XRectangle *r = &Damage.rects[i];
+        XCopyArea(
+            state->display, state->backing, state->window,
+            state->gc,
+            r->x, r->y,
+            r->width, r->height,
+            r->x, r->y
+        );
+    }
+    if (Damage.count > 0) XFlush(state->display);
+    Damage.count = 0;
+    return count;
+}
+
+void free_image(Window_State *state, Image *img) {
+    if (img->shm) {
+        XShmDetach(state->display, &img->shm_info);
+        XSync(state->display, 0);
+        shmdt(img->shm_info.shmaddr);
+        img->ximage->data = NULL;
+    }
+    XDestroyImage(img->ximage);
+    free(img);
 }
 
 void begin_drawing(Window_State *state) {
     XEvent event = {};
 
+    Mouse.button = Mouse_Button0;
+    Mouse.released = 0;
+    Keyboard.key = NoSymbol;
+    Mouse.moved = 0;
     XNextEvent(state->display, &event);
     switch (event.type) {
         case ButtonPress: {
@@ -207,8 +824,30 @@ void begin_drawing(Window_State *state) {
 
             break;
         }
+        case ButtonRelease: {
+            if (event.xbutton.button == Button1) {
+                Mouse.button = Mouse_Button1;
+                Mouse.released = 1;
+                Mouse.x = event.xbutton.x;
+                Mouse.y = event.xbutton.y;
+            }
+
+            break;
+        }
+        case Expose: {
+            damage_add(
+                event.xexpose.x, event.xexpose.y,
+                event.xexpose.width, event.xexpose.height
+            );
+            break;
+        }
         case MotionNotify: {
+            // Only the latest position matters, drop the queued motion.
+            while (XCheckTypedWindowEvent(
+                state->display, state->window, MotionNotify, &event
+            ));
             Mouse.button = Mouse_Button0;
+            Mouse.moved = 1;
             Mouse.x = event.xmotion.x;
             Mouse.y = event.xmotion.y;
             break;
@@ -217,6 +856,7 @@ void begin_drawing(Window_State *state) {
             switch(event.xkey.keycode) {
                 case 0x09: WindowShouldClose = 1;
             }
+            Keyboard.key = XLookupKeysym(&event.xkey, 0);
 
             return;
         }
@@ -236,40 +876,918 @@ void begin_drawing(Window_State *state) {
 }
 
 void close_window(Window_State *state) {
+    free(state->format.cache);
+    if (state->backing) XFreePixmap(state->display, state->backing);
     XFreeGC(state->display, state->gc);
     XDestroyWindow(state->display, state->window);
     XCloseDisplay(state->display);
 }
 
+// Whether pixels of `ximage` can be accessed directly as host order 32 bit
+// values, without going through XGetPixel.
+int is_native_32(XImage *ximage) {
+    const unsigned int one = 1;
+    int host_order = *(const unsigned char *)&one ? LSBFirst : MSBFirst;
+    return ximage->bits_per_pixel == 32 && ximage->byte_order == host_order;
+}
+
 Color get_pixel_from_img(Window_State *state, Image *img, int x, int y) {
-    Color color;
-    color.pixel = XGetPixel(img, x, y);
+    return decode_pixel(state, XGetPixel(img->ximage, x, y));
+}
 
-    XQueryColor(
-        state->display, XDefaultColormap(state->display,
-         XDefaultScreen (state->display)), &color
-    );
+// Decodes `count` pixels of the row starting at `x`, `y` into `colors`.
+void get_pixels_from_img(
+    Window_State *state, Image *img, int x, int y, int count, Color *colors
+) {
+    XImage *ximage = img->ximage;
+    if (is_native_32(ximage)) {
+        unsigned int *row = (unsigned int *)(ximage->data + y * ximage->bytes_per_line) + x;
+        for (int i = 0; i < count; i++) colors[i] = decode_pixel(state, row[i]);
+    } else {
+        for (int i = 0; i < count; i++) {
+            colors[i] = decode_pixel(state, XGetPixel(ximage, x + i, y));
+        }
+    }
+}
 
-    color.red = color.red/256;
-    color.green = color.red/256;
-    color.blue = color.red/256;
+/*******************************************************************************
+ * Area sampling
+ *
+ * The kernels work on the four byte lanes of 32 bit pixels. Images with
+ * 8 bit channels are sampled in place, anything else is decoded into
+ * `Sample_Buffer` first.
+ *******************************************************************************/
+
+static unsigned int Sample_Buffer[MAX_SAMPLE_SIZE * MAX_SAMPLE_SIZE];
+
+void kernel_box_sum(
+    const unsigned char *data, int stride, int width, int height,
+    unsigned int sums[4]
+) {
+    for (int k = 0; k < 4; k++) sums[k] = 0;
 
+    for (int y = 0; y < height; y++) {
+        const unsigned char *row = data + y * stride;
+        int x = 0;
+#ifdef __SSE2__
+        // Two pixels per 16 bit half, a row of MAX_SAMPLE_SIZE can't overflow.
+        __m128i zero = _mm_setzero_si128();
+        __m128i acc16 = zero;
+        for (; x + 4 <= width; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + x * 4));
+            acc16 = _mm_add_epi16(acc16, _mm_unpacklo_epi8(v, zero));
+            acc16 = _mm_add_epi16(acc16, _mm_unpackhi_epi8(v, zero));
+        }
+        __m128i acc32 = _mm_add_epi32(
+            _mm_unpacklo_epi16(acc16, zero), _mm_unpackhi_epi16(acc16, zero)
+        );
+        unsigned int lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, acc32);
+        for (int k = 0; k < 4; k++) sums[k] += lanes[k];
+#endif // __SSE2__
+        for (; x < width; x++) {
+            for (int k = 0; k < 4; k++) sums[k] += row[x * 4 + k];
+        }
+    }
+}
+
+void kernel_weighted_sum(
+    const unsigned char *data, int stride, int width, int height,
+    const float *weight_x, const float *weight_y, float sums[4]
+) {
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128 acc = _mm_setzero_ps();
+    for (int y = 0; y < height; y++) {
+        const unsigned char *row = data + y * stride;
+        for (int x = 0; x < width; x++) {
+            unsigned int pixel;
+            memcpy(&pixel, row + x * 4, 4);
+            __m128i lanes = _mm_unpacklo_epi16(
+                _mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero
+            );
+            __m128 weight = _mm_set1_ps(weight_x[x] * weight_y[y]);
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_cvtepi32_ps(lanes), weight));
+        }
+    }
+    _mm_storeu_ps(sums, acc);
+#else
+    for (int k = 0; k < 4; k++) sums[k] = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned char *row = data + y * stride;
+        for (int x = 0; x < width; x++) {
+            float weight = weight_x[x] * weight_y[y];
+            for (int k = 0; k < 4; k++) sums[k] += row[x * 4 + k] * weight;
+        }
+    }
+#endif // __SSE2__
+}
+
+void kernel_median(
+    const unsigned char *data, int stride, int width, int height,
+    unsigned char median[4]
+) {
+    unsigned int histogram[4][256] = {0};
+    for (int y = 0; y < height; y++) {
+        const unsigned char *row = data + y * stride;
+        for (int x = 0; x < width; x++) {
+            for (int k = 0; k < 4; k++) histogram[k][row[x * 4 + k]]++;
+        }
+    }
+
+    unsigned int half = (width * height + 1) / 2;
+    for (int k = 0; k < 4; k++) {
+        unsigned int seen = 0;
+        int value = 0;
+        while (value < 255 && (seen += histogram[k][value]) < half) value++;
+        median[k] = value;
+    }
+}
+
+// Weights of a Gaussian centered on `center`, for `count` pixels starting
+// at `start`.
+void gauss_weights(float *weights, int start, int count, int center, int size) {
+    float sigma = size / 4.0f;
+    if (sigma < 0.5f) sigma = 0.5f;
+    for (int i = 0; i < count; i++) {
+        float d = start + i - center;
+        weights[i] = expf(-(d * d) / (2 * sigma * sigma));
+    }
+}
+
+int is_byte_aligned(Pixel_Format *format) {
+    Channel_Format *channels[3] = { &format->red, &format->green, &format->blue };
+    if (!format->true_color) return 0;
+    for (int i = 0; i < 3; i++) {
+        if (channels[i]->bits != 8 || channels[i]->shift % 8 != 0) return 0;
+    }
+    return 1;
+}
+
+// Combines the SampleSize x SampleSize area around `x`, `y` with SampleMode.
+Color sample_from_img(Window_State *state, Image *img, int x, int y) {
+    int half = SampleSize / 2;
+    int x0 = x - half, y0 = y - half;
+    int x1 = x0 + SampleSize, y1 = y0 + SampleSize;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > img->width) x1 = img->width;
+    if (y1 > img->height) y1 = img->height;
+
+    int width = x1 - x0, height = y1 - y0;
+    if (SampleSize == 1 || width <= 0 || height <= 0) {
+        if (x < 0) x = 0;
+        if (y < 0) y = 0;
+        if (x >= img->width) x = img->width - 1;
+        if (y >= img->height) y = img->height - 1;
+        return get_pixel_from_img(state, img, x, y);
+    }
+
+    // In place sampling gives lanes in the pixel layout of the image,
+    // decoded sampling gives them as 0x00RRGGBB.
+    const unsigned char *data;
+    int stride;
+    int in_place = is_native_32(img->ximage) && is_byte_aligned(&state->format);
+    if (in_place) {
+        data = (const unsigned char *)img->ximage->data
+            + y0 * img->ximage->bytes_per_line + x0 * 4;
+        stride = img->ximage->bytes_per_line;
+    } else {
+        Color row[MAX_SAMPLE_SIZE];
+        for (int j = 0; j < height; j++) {
+            get_pixels_from_img(state, img, x0, y0 + j, width, row);
+            for (int i = 0; i < width; i++) {
+                Sample_Buffer[j * width + i] =
+                    (row[i].red << 16) | (row[i].green << 8) | row[i].blue;
+            }
+        }
+        data = (const unsigned char *)Sample_Buffer;
+        stride = width * 4;
+    }
+
+    unsigned char lanes[4] = {0};
+    switch (SampleMode) {
+        case SAMPLE_MEAN: {
+            unsigned int sums[4];
+            unsigned int count = width * height;
+            kernel_box_sum(data, stride, width, height, sums);
+            for (int k = 0; k < 4; k++) lanes[k] = (sums[k] + count / 2) / count;
+            break;
+        }
+        case SAMPLE_GAUSS: {
+            float weight_x[MAX_SAMPLE_SIZE], weight_y[MAX_SAMPLE_SIZE], sums[4];
+            float total_x = 0, total_y = 0;
+            gauss_weights(weight_x, x0, width, x, SampleSize);
+            gauss_weights(weight_y, y0, height, y, SampleSize);
+            for (int i = 0; i < width; i++) total_x += weight_x[i];
+            for (int j = 0; j < height; j++) total_y += weight_y[j];
+
+            kernel_weighted_sum(data, stride, width, height, weight_x, weight_y, sums);
+            for (int k = 0; k < 4; k++) lanes[k] = sums[k] / (total_x * total_y) + 0.5f;
+            break;
+        }
+        case SAMPLE_MEDIAN: {
+            kernel_median(data, stride, width, height, lanes);
+            break;
+        }
+        default: break;
+    }
+
+    unsigned int pixel;
+    memcpy(&pixel, lanes, 4);
+    if (in_place) return decode_pixel(state, pixel);
+
+    Color color = { .pixel = pixel };
+    color.red = (pixel >> 16) & 0xFF;
+    color.green = (pixel >> 8) & 0xFF;
+    color.blue = pixel & 0xFF;
     return color;
 }
 
+/*******************************************************************************
+ * Palette
+ *
+ * k-means over packed 0x00RRGGBB pixels. Each iteration splits the pixels
+ * across threads; every thread finds the nearest centroid for its share,
+ * four centroids at a time with SSE2, and sums up its clusters locally.
+ * The threads live for the whole run and meet at barriers around each
+ * iteration.
+ *******************************************************************************/
+
+#define PALETTE_ITERATIONS 32
+#define PALETTE_SEEDS 4096
+#define PALETTE_MIN_PIXELS_PER_THREAD 16384
+
+// Unused centroids are kept far away so they never win.
+#define PALETTE_FAR_AWAY 1e30f
+
+typedef struct {
+    float red[MAX_PALETTE_SIZE];
+    float green[MAX_PALETTE_SIZE];
+    float blue[MAX_PALETTE_SIZE];
+    int count;
+} Centroids;
+
+typedef struct {
+    const unsigned int *pixels;
+    size_t count;
+    const Centroids *centroids;
+    double sums[MAX_PALETTE_SIZE][3];
+    size_t members[MAX_PALETTE_SIZE];
+    // Shared by all jobs: an iteration runs between `start` and `done`,
+    // `quit` is set before the last `start`.
+    pthread_barrier_t *start;
+    pthread_barrier_t *done;
+    const int *quit;
+} Palette_Job;
+
+typedef struct {
+    unsigned int pixel;
+    size_t members;
+} Palette_Entry;
+
+int nearest_centroid(const Centroids *centroids, float red, float green, float blue) {
+    int padded = (centroids->count + 3) & ~3;
+    float best_distance = PALETTE_FAR_AWAY;
+    int best = 0;
+#ifdef __SSE2__
+    __m128 r = _mm_set1_ps(red), g = _mm_set1_ps(green), b = _mm_set1_ps(blue);
+    for (int i = 0; i < padded; i += 4) {
+        __m128 dr = _mm_sub_ps(_mm_loadu_ps(centroids->red + i), r);
+        __m128 dg = _mm_sub_ps(_mm_loadu_ps(centroids->green + i), g);
+        __m128 db = _mm_sub_ps(_mm_loadu_ps(centroids->blue + i), b);
+        __m128 d = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db)
+        );
+
+        float distances[4];
+        _mm_storeu_ps(distances, d);
+        for (int k = 0; k < 4; k++) {
+            if (distances[k] < best_distance) {
+                best_distance = distances[k];
+                best = i + k;
+            }
+        }
+    }
+#else
+    for (int i = 0; i < padded; i++) {
+        float dr = centroids->red[i] - red;
+        float dg = centroids->green[i] - green;
+        float db = centroids->blue[i] - blue;
+        float d = dr * dr + dg * dg + db * db;
+        if (d < best_distance) {
+            best_distance = d;
+            best = i;
+        }
+    }
+#endif // __SSE2__
+    return best;
+}
+
+void *palette_worker(void *arg) {
+    Palette_Job *job = arg;
+    memset(job->sums, 0, sizeof(job->sums));
+    memset(job->members, 0, sizeof(job->members));
+
+    for (size_t i = 0; i < job->count; i++) {
+        unsigned int pixel = job->pixels[i];
+        float red = (pixel >> 16) & 0xFF;
+        float green = (pixel >> 8) & 0xFF;
+        float blue = pixel & 0xFF;
+
+        int best = nearest_centroid(job->centroids, red, green, blue);
+        job->sums[best][0] += red;
+        job->sums[best][1] += green;
+        job->sums[best][2] += blue;
+        job->members[best]++;
+    }
+    return NULL;
+}
+
+void *palette_thread(void *arg) {
+    Palette_Job *job = arg;
+    while (1) {
+        pthread_barrier_wait(job->start);
+        if (*job->quit) return NULL;
+        palette_worker(job);
+        pthread_barrier_wait(job->done);
+    }
+}
+
+// Picks the initial centroids with k-means++ over an evenly spread subset
+// of the pixels, with a fixed seed so results are repeatable.
+void palette_seed(Centroids *centroids, const unsigned int *pixels, size_t count, int size) {
+    static float distances[PALETTE_SEEDS];
+    size_t step = count > PALETTE_SEEDS ? count / PALETTE_SEEDS : 1;
+    size_t seeds = count / step;
+    if (seeds > PALETTE_SEEDS) seeds = PALETTE_SEEDS;
+    unsigned int random = 2463534242u;
+
+    for (int i = 0; i < MAX_PALETTE_SIZE; i++) {
+        centroids->red[i] = centroids->green[i] = centroids->blue[i] = PALETTE_FAR_AWAY;
+    }
+    centroids->count = 0;
+
+    size_t pick = 0;
+    while (centroids->count < size) {
+        unsigned int pixel = pixels[pick * step];
+        int i = centroids->count++;
+        centroids->red[i] = (pixel >> 16) & 0xFF;
+        centroids->green[i] = (pixel >> 8) & 0xFF;
+        centroids->blue[i] = pixel & 0xFF;
+
+        double total = 0;
+        for (size_t j = 0; j < seeds; j++) {
+            unsigned int p = pixels[j * step];
+            float red = (p >> 16) & 0xFF, green = (p >> 8) & 0xFF, blue = p & 0xFF;
+            int near = nearest_centroid(centroids, red, green, blue);
+            float dr = centroids->red[near] - red;
+            float dg = centroids->green[near] - green;
+            float db = centroids->blue[near] - blue;
+            distances[j] = dr * dr + dg * dg + db * db;
+            total += distances[j];
+        }
+        // Every pixel already has an exact match, fewer colors than asked.
+        if (total == 0) break;
+
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        double target = total * (random / 4294967296.0);
+        for (pick = 0; pick < seeds - 1 && (target -= distances[pick]) > 0; pick++);
+    }
+}
+
+int palette_entry_cmp(const void *a, const void *b) {
+    const Palette_Entry *x = a, *y = b;
+    return (x->members < y->members) - (x->members > y->members);
+}
+
+void print_palette(const unsigned int *pixels, size_t count) {
+    if (count == 0) return;
+
+    int threads = PaletteThreads ? PaletteThreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if ((size_t)threads > count / PALETTE_MIN_PIXELS_PER_THREAD) {
+        threads = count / PALETTE_MIN_PIXELS_PER_THREAD;
+        if (threads < 1) threads = 1;
+    }
+
+    Palette_Job *jobs = calloc(threads, sizeof(Palette_Job));
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    if (!jobs || !ids) {
+        fprintf(stderr, "Couldn't allocate palette jobs.\n");
+        exit(1);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Centroids centroids;
+    palette_seed(&centroids, pixels, count, PaletteSize);
+
+    pthread_barrier_t start_barrier, done_barrier;
+    int quit = 0;
+    pthread_barrier_init(&start_barrier, NULL, threads);
+    pthread_barrier_init(&done_barrier, NULL, threads);
+
+    size_t share = (count + threads - 1) / threads;
+    for (int t = 0; t < threads; t++) {
+        size_t first = t * share;
+        jobs[t].pixels = pixels + first;
+        jobs[t].count = first >= count ? 0 : (count - first < share ? count - first : share);
+        jobs[t].centroids = &centroids;
+        jobs[t].start = &start_barrier;
+        jobs[t].done = &done_barrier;
+        jobs[t].quit = &quit;
+    }
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&ids[t], NULL, palette_thread, &jobs[t])) {
+            fprintf(stderr, "Couldn't start palette thread.\n");
+            exit(1);
+        }
+    }
+
+    size_t members[MAX_PALETTE_SIZE];
+    int iteration = 0;
+    for (; iteration < PALETTE_ITERATIONS; iteration++) {
+        // The barriers also order the centroid updates below against the
+        // workers' reads.
+        pthread_barrier_wait(&start_barrier);
+        palette_worker(&jobs[0]);
+        pthread_barrier_wait(&done_barrier);
+
+        float moved = 0;
+        for (int i = 0; i < centroids.count; i++) {
+            double sums[3] = {0};
+            members[i] = 0;
+            for (int t = 0; t < threads; t++) {
+                for (int c = 0; c < 3; c++) sums[c] += jobs[t].sums[i][c];
+                members[i] += jobs[t].members[i];
+            }
+            if (members[i] == 0) continue;
+
+            float red = sums[0] / members[i];
+            float green = sums[1] / members[i];
+            float blue = sums[2] / members[i];
+            float dr = red - centroids.red[i];
+            float dg = green - centroids.green[i];
+            float db = blue - centroids.blue[i];
+            if (dr * dr + dg * dg + db * db > moved) moved = dr * dr + dg * dg + db * db;
+
+            centroids.red[i] = red;
+            centroids.green[i] = green;
+            centroids.blue[i] = blue;
+        }
+        if (moved < 0.25f) break;
+    }
+
+    quit = 1;
+    pthread_barrier_wait(&start_barrier);
+    for (int t = 1; t < threads; t++) pthread_join(ids[t], NULL);
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&done_barrier);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    Palette_Entry entries[MAX_PALETTE_SIZE];
+    int entry_count = 0;
+    for (int i = 0; i < centroids.count; i++) {
+        if (members[i] == 0) continue;
+        entries[entry_count].pixel =
+            ((int)(centroids.red[i] + 0.5f) << 16) |
+            ((int)(centroids.green[i] + 0.5f) << 8) |
+            (int)(centroids.blue[i] + 0.5f);
+        entries[entry_count].members = members[i];
+        entry_count++;
+    }
+    qsort(entries, entry_count, sizeof(Palette_Entry), palette_entry_cmp);
+
+    for (int i = 0; i < entry_count; i++) {
+        printf("#%06X %6.2f%%\n", entries[i].pixel, 100.0 * entries[i].members / count);
+    }
+    fprintf(stderr, "Palette of %zu pixels in %.2f ms, %d iterations, %d threads\n",
+        count,
+        (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+        iteration < PALETTE_ITERATIONS ? iteration + 1 : iteration, threads
+    );
+
+    free(ids);
+    free(jobs);
+}
+
+void print_palette_from_img(
+    Window_State *state, Image *img, int x, int y, int width, int height
+) {
+    unsigned int *pixels = malloc((size_t)width * height * sizeof(unsigned int));
+    Color *row = malloc(width * sizeof(Color));
+    if (!pixels || !row) {
+        fprintf(stderr, "Couldn't allocate palette pixels.\n");
+        exit(1);
+    }
+
+    for (int j = 0; j < height; j++) {
+        get_pixels_from_img(state, img, x, y + j, width, row);
+        for (int i = 0; i < width; i++) {
+            pixels[(size_t)j * width + i] =
+                (row[i].red << 16) | (row[i].green << 8) | row[i].blue;
+        }
+    }
+    print_palette(pixels, (size_t)width * height);
+
+    free(row);
+    free(pixels);
+}
+
+// Reads the next header number of a PNM file, skipping `#` comments.
+long pnm_number(const unsigned char *data, size_t size, size_t *pos) {
+    while (*pos < size) {
+        if (data[*pos] == '#') {
+            while (*pos < size && data[*pos] != '\n') (*pos)++;
+        } else if (data[*pos] == ' ' || data[*pos] == '\t' || data[*pos] == '\r' || data[*pos] == '\n') {
+            (*pos)++;
+        } else {
+            break;
+        }
+    }
+
+    long value = -1;
+    while (*pos < size && data[*pos] >= '0' && data[*pos] <= '9') {
+        value = (value < 0 ? 0 : value * 10) + (data[*pos] - '0');
+        if (value > 1 << 24) return -1;
+        (*pos)++;
+    }
+    return value;
+}
+
+// Loads a binary or plain PPM (P6/P3) or PGM (P5/P2) file as packed pixels.
+unsigned int *load_pnm(const char *path, size_t *count) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: couldn't open `%s`.\n", path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    unsigned char *data = malloc(size > 0 ? size : 1);
+    if (!data || size < 2 || fread(data, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "Error: couldn't read `%s`.\n", path);
+        exit(1);
+    }
+    fclose(file);
+
+    char kind = data[0] == 'P' ? data[1] : 0;
+    int channels = (kind == '3' || kind == '6') ? 3 : (kind == '2' || kind == '5') ? 1 : 0;
+    int binary = kind == '5' || kind == '6';
+    size_t pos = 2;
+    long width = pnm_number(data, size, &pos);
+    long height = pnm_number(data, size, &pos);
+    long max_value = pnm_number(data, size, &pos);
+    if (!channels || width <= 0 || height <= 0 || max_value <= 0 || max_value > 65535) {
+        fprintf(stderr, "Error: `%s` isn't a supported PPM/PGM file.\n", path);
+        exit(1);
+    }
+    pos++;
+
+    int sample_size = max_value > 255 ? 2 : 1;
+    *count = (size_t)width * height;
+    if (binary && pos + *count * channels * sample_size > (size_t)size) {
+        fprintf(stderr, "Error: `%s` is truncated.\n", path);
+        exit(1);
+    }
+
+    unsigned int *pixels = malloc(*count * sizeof(unsigned int));
+    if (!pixels) {
+        fprintf(stderr, "Couldn't allocate palette pixels.\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < *count; i++) {
+        unsigned int rgb[3];
+        for (int c = 0; c < channels; c++) {
+            long value;
+            if (!binary) {
+                value = pnm_number(data, size, &pos);
+                if (value < 0) {
+                    fprintf(stderr, "Error: `%s` is truncated.\n", path);
+                    exit(1);
+                }
+            } else if (sample_size == 2) {
+                value = (data[pos] << 8) | data[pos + 1];
+                pos += 2;
+            } else {
+                value = data[pos++];
+            }
+            // Larger values would spill into the next channel once packed.
+            if (value > max_value) {
+                fprintf(stderr, "Error: `%s` has a sample above its maximum value %ld.\n", path, max_value);
+                exit(1);
+            }
+            rgb[c] = max_value == 255 ? value : (value * 255 + max_value / 2) / max_value;
+        }
+        if (channels == 1) rgb[1] = rgb[2] = rgb[0];
+        pixels[i] = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
+    }
+
+    free(data);
+    return pixels;
+}
+
+void selection_rect(int *x, int *y, int *width, int *height) {
+    *x = Selection.x0 < Selection.x1 ? Selection.x0 : Selection.x1;
+    *y = Selection.y0 < Selection.y1 ? Selection.y0 : Selection.y1;
+    *width = abs(Selection.x1 - Selection.x0) + 1;
+    *height = abs(Selection.y1 - Selection.y0) + 1;
+}
+
+// Marks the edges of the shown selection as damaged.
+void damage_selection(void) {
+    if (!Selection.shown) return;
+
+    int x, y, width, height;
+    selection_rect(&x, &y, &width, &height);
+    damage_add(x, y, width, 1);
+    damage_add(x, y + height - 1, width, 1);
+    damage_add(x, y, 1, height);
+    damage_add(x + width - 1, y, 1, height);
+    Selection.shown = 0;
+}
+
+void draw_selection(Window_State *state) {
+    int x, y, width, height;
+    selection_rect(&x, &y, &width, &height);
+
+    XSetForeground(state->display, state->gc, WhitePixel(state->display, DefaultScreen(state->display)));
+    XDrawRectangle(state->display, state->window, state->gc, x, y, width - 1, height - 1);
+    Selection.shown = 1;
+}
+
 void print_hex_from_img(Window_State *state, Image *img, int x, int y) {
-    Color color = get_pixel_from_img(state, img, x, y);
+    Color color = sample_from_img(state, img, x, y);
     printf("#%02X%02X%02X\n", color.red, color.green, color.blue);
 }
 
 void print_rgb_from_img(Window_State *state, Image *img, int x, int y) {
-    Color color = get_pixel_from_img(state, img, x, y);
+    Color color = sample_from_img(state, img, x, y);
     printf("rgb(%d %d %d)\n", color.red, color.green, color.blue);
 }
 
+void print_pick(Pick *pick, Output_Format format) {
+    Color color = pick->color;
+    switch (format) {
+        case OUTPUT_HEX: {
+            printf("#%02X%02X%02X\n", color.red, color.green, color.blue);
+            break;
+        }
+        case OUTPUT_RGB: {
+            printf("rgb(%d %d %d)\n", color.red, color.green, color.blue);
+            break;
+        }
+        case OUTPUT_JSON: {
+            printf("{\"x\": %d, \"y\": %d, \"hex\": \"#%02X%02X%02X\", \"rgb\": [%d, %d, %d]}",
+                pick->x, pick->y,
+                color.red, color.green, color.blue,
+                color.red, color.green, color.blue
+            );
+            break;
+        }
+        default: break;
+    }
+}
+
+void update_pick_title(Window_State *state) {
+    char title[64];
+    snprintf(title, sizeof(title), PROJECT_NAME": %d picked", Picks.count);
+    XStoreName(state->display, state->window, title);
+}
+
+void add_pick(Window_State *state, Image *img, int x, int y) {
+    if (x < 0 || y < 0 || x >= img->width || y >= img->height) return;
+
+    if (Picks.count == Picks.capacity) {
+        Picks.capacity = Picks.capacity ? Picks.capacity * 2 : 32;
+        Picks.items = realloc(Picks.items, Picks.capacity * sizeof(Pick));
+        if (!Picks.items) {
+            fprintf(stderr, "Couldn't allocate picks.\n");
+            exit(1);
+        }
+    }
+
+    Pick *pick = &Picks.items[Picks.count++];
+    pick->color = sample_from_img(state, img, x, y);
+    pick->x = state->screen_x + x;
+    pick->y = state->screen_y + y;
+
+    if (Stream) {
+        print_pick(pick, OutputFormat);
+        if (OutputFormat == OUTPUT_JSON) printf("\n");
+        fflush(stdout);
+    }
+    update_pick_title(state);
+}
+
+void undo_pick(Window_State *state) {
+    if (Picks.count == 0) return;
+    Picks.count--;
+
+    // Streamed picks are out already, tell the reader to drop the last one.
+    if (Stream) {
+        if (OutputFormat == OUTPUT_JSON) {
+            printf("{\"undo\": ");
+            print_pick(&Picks.items[Picks.count], OutputFormat);
+            printf("}\n");
+        } else {
+            printf("undo\n");
+        }
+        fflush(stdout);
+    }
+    update_pick_title(state);
+}
+
+void print_picks(void) {
+    if (OutputFormat == OUTPUT_JSON) printf("[\n");
+    for (int i = 0; i < Picks.count; i++) {
+        if (OutputFormat == OUTPUT_JSON) printf("    ");
+        print_pick(&Picks.items[i], OutputFormat);
+        if (OutputFormat == OUTPUT_JSON) printf(i + 1 < Picks.count ? ",\n" : "\n");
+    }
+    if (OutputFormat == OUTPUT_JSON) printf("]\n");
+}
+
+// Enlarges the pixels under the cursor from the screen image and moves the
+// loupe next to the cursor. The old loupe area is marked as damaged.
+void move_loupe(Window_State *state, Image *img, int x, int y) {
+    if (!Loupe.zoomed) return;
+
+    if (Loupe.shown) {
+        damage_add(
+            Loupe.x - LOUPE_BORDER, Loupe.y - LOUPE_BORDER,
+            Loupe.width + 2 * LOUPE_BORDER, Loupe.height + 2 * LOUPE_BORDER
+        );
+    }
+
+    int half = Loupe.size / 2;
+    Loupe.region_x = x - half;
+    Loupe.region_y = y - half;
+    if (Loupe.region_x > state->screen_width - Loupe.size) {
+        Loupe.region_x = state->screen_width - Loupe.size;
+    }
+    if (Loupe.region_y > state->screen_height - Loupe.size) {
+        Loupe.region_y = state->screen_height - Loupe.size;
+    }
+    if (Loupe.region_x < 0) Loupe.region_x = 0;
+    if (Loupe.region_y < 0) Loupe.region_y = 0;
+
+    // The server may still be reading the previous frame out of the shared
+    // segment, wait for it before overwriting it.
+    if (Loupe.zoomed->shm) XSync(state->display, False);
+
+    XImage *src = img->ximage;
+    XImage *dst = Loupe.zoomed->ximage;
+    int native = is_native_32(dst);
+    for (int j = 0; j < Loupe.size; j++) {
+        for (int i = 0; i < Loupe.size; i++) {
+            unsigned long pixel = XGetPixel(src, Loupe.region_x + i, Loupe.region_y + j);
+            for (int dy = 0; dy < LOUPE_SCALE; dy++) {
+                int row = j * LOUPE_SCALE + dy;
+                if (native) {
+                    unsigned int *line = (unsigned int *)(dst->data + row * dst->bytes_per_line);
+                    for (int dx = 0; dx < LOUPE_SCALE; dx++) {
+                        line[i * LOUPE_SCALE + dx] = pixel;
+                    }
+                } else {
+                    for (int dx = 0; dx < LOUPE_SCALE; dx++) {
+                        XPutPixel(dst, i * LOUPE_SCALE + dx, row, pixel);
+                    }
+                }
+            }
+        }
+    }
+
+    Loupe.x = x + LOUPE_OFFSET;
+    Loupe.y = y + LOUPE_OFFSET;
+    if (Loupe.x + Loupe.width > state->screen_width) Loupe.x = x - LOUPE_OFFSET - Loupe.width;
+    if (Loupe.y + Loupe.height > state->screen_height) Loupe.y = y - LOUPE_OFFSET - Loupe.height;
+    Loupe.shown = 1;
+    Loupe.dirty = 1;
+}
+
+void init_loupe(Window_State *state, Image *img) {
+    if (ZoomSize == 0) return;
+
+    Loupe.size = ZoomSize;
+    if (Loupe.size > state->screen_width) Loupe.size = state->screen_width;
+    if (Loupe.size > state->screen_height) Loupe.size = state->screen_height;
+    Loupe.zoomed = create_img(state, Loupe.size * LOUPE_SCALE, Loupe.size * LOUPE_SCALE);
+    Loupe.width = Loupe.zoomed->width;
+    Loupe.height = Loupe.zoomed->height + LOUPE_LABEL_HEIGHT;
+
+    Window root, child;
+    int root_x, root_y;
+    unsigned int mask;
+    if (XQueryPointer(
+        state->display, state->window, &root, &child,
+        &root_x, &root_y, &Mouse.x, &Mouse.y, &mask
+    )) {
+        // begin_drawing clears Mouse.moved, so place the loupe right away;
+        // it's drawn at the end of the first frame as it's dirty.
+        move_loupe(state, img, Mouse.x, Mouse.y);
+    }
+}
+
+void draw_loupe(Window_State *state, Image *img) {
+    if (!Loupe.shown) return;
+
+    put_img(state, Loupe.zoomed, state->window, Loupe.x, Loupe.y);
+
+    int screen = DefaultScreen(state->display);
+    unsigned long white = WhitePixel(state->display, screen);
+    unsigned long black = BlackPixel(state->display, screen);
+    int cx = Mouse.x - Loupe.region_x;
+    int cy = Mouse.y - Loupe.region_y;
+    if (cx < 0) cx = 0;
+    if (cy < 0) cy = 0;
+    if (cx >= Loupe.size) cx = Loupe.size - 1;
+    if (cy >= Loupe.size) cy = Loupe.size - 1;
+
+    Color color = sample_from_img(state, img, Mouse.x, Mouse.y);
+    char label[32];
+    int label_len;
+    if (SampleSize == 1) {
+        label_len = snprintf(label, sizeof(label), "#%02X%02X%02X",
+            color.red, color.green, color.blue
+        );
+    } else {
+        label_len = snprintf(label, sizeof(label), "#%02X%02X%02X %dx%d %s",
+            color.red, color.green, color.blue,
+            SampleSize, SampleSize, Sample_Mode_Names[SampleMode]
+        );
+    }
+
+    XSetForeground(state->display, state->gc, black);
+    XFillRectangle(
+        state->display, state->window, state->gc,
+        Loupe.x, Loupe.y + Loupe.zoomed->height,
+        Loupe.width, LOUPE_LABEL_HEIGHT
+    );
+    XDrawRectangle(
+        state->display, state->window, state->gc,
+        Loupe.x, Loupe.y, Loupe.width - 1, Loupe.height - 1
+    );
+    XDrawRectangle(
+        state->display, state->window, state->gc,
+        Loupe.x + cx * LOUPE_SCALE - 1, Loupe.y + cy * LOUPE_SCALE - 1,
+        LOUPE_SCALE + 1, LOUPE_SCALE + 1
+    );
+
+    XSetForeground(state->display, state->gc, white);
+    XDrawRectangle(
+        state->display, state->window, state->gc,
+        Loupe.x + cx * LOUPE_SCALE, Loupe.y + cy * LOUPE_SCALE,
+        LOUPE_SCALE - 1, LOUPE_SCALE - 1
+    );
+    if (SampleSize > 1) {
+        // Outline the sampled area, clipped to the loupe.
+        int x0 = cx - SampleSize / 2, y0 = cy - SampleSize / 2;
+        int x1 = x0 + SampleSize, y1 = y0 + SampleSize;
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x1 > Loupe.size) x1 = Loupe.size;
+        if (y1 > Loupe.size) y1 = Loupe.size;
+        XDrawRectangle(
+            state->display, state->window, state->gc,
+            Loupe.x + x0 * LOUPE_SCALE, Loupe.y + y0 * LOUPE_SCALE,
+            (x1 - x0) * LOUPE_SCALE - 1, (y1 - y0) * LOUPE_SCALE - 1
+        );
+    }
+    XDrawString(
+        state->display, state->window, state->gc,
+        Loupe.x + 4, Loupe.y + Loupe.height - 5,
+        label, label_len
+    );
+
+    XFlush(state->display);
+    Loupe.dirty = 0;
+}
+
+void free_loupe(Window_State *state) {
+    if (Loupe.zoomed) free_image(state, Loupe.zoomed);
+}
+
 int main(int argc, char *argv[]) {
     cli_init(argc, argv);
 
+    if (PaletteFile) {
+        if (!PaletteSize) PaletteSize = 8;
+        size_t count;
+        unsigned int *pixels = load_pnm(PaletteFile, &count);
+        print_palette(pixels, count);
+        free(pixels);
+        return 0;
+    }
+
     Window_State state = {0};
 
     init_window(&state, 800, 600, "cpick");
@@ -279,25 +1797,83 @@ int main(int argc, char *argv[]) {
     }
 
     Image *img = get_screen_img(&state);
+    upload_img(&state, img);
     set_plus_cursor(&state);
+    init_loupe(&state, img);
 
     while(!WindowShouldClose) {
         begin_drawing(&state);
 
-        if (Mouse.button == Mouse_Button1) {
-            WindowShouldClose = 1;
-            print_hex_from_img(&state, img, Mouse.x, Mouse.y);
+        if (Mouse.moved) move_loupe(&state, img, Mouse.x, Mouse.y);
+
+        if (Mouse.button == Mouse_Button4 && SampleSize < MAX_SAMPLE_SIZE) {
+            SampleSize++;
+            Loupe.dirty = 1;
         }
 
-        if (Mouse.button == Mouse_Button3) {
-            WindowShouldClose = 1;
-            print_rgb_from_img(&state, img, Mouse.x, Mouse.y);
+        if (Mouse.button == Mouse_Button5 && SampleSize > 1) {
+            SampleSize--;
+            Loupe.dirty = 1;
         }
 
-        put_img(&state, img, 0, 0, state.screen_width, state.screen_height);
+        if (PaletteSize) {
+            if (Mouse.button == Mouse_Button1 && !Mouse.released) {
+                Selection.active = 1;
+                Selection.x0 = Selection.x1 = Mouse.x;
+                Selection.y0 = Selection.y1 = Mouse.y;
+            } else if (Selection.active && Mouse.moved) {
+                damage_selection();
+                Selection.x1 = Mouse.x;
+                Selection.y1 = Mouse.y;
+            } else if (Selection.active && Mouse.released) {
+                WindowShouldClose = 1;
+                Selection.x1 = Mouse.x;
+                Selection.y1 = Mouse.y;
+
+                int x, y, width, height;
+                selection_rect(&x, &y, &width, &height);
+                if (width == 1 && height == 1) {
+                    x = y = 0;
+                    width = img->width;
+                    height = img->height;
+                }
+                if (x < 0) { width += x; x = 0; }
+                if (y < 0) { height += y; y = 0; }
+                if (x + width > img->width) width = img->width - x;
+                if (y + height > img->height) height = img->height - y;
+                if (x >= 0 && y >= 0 && width > 0 && height > 0) {
+                    print_palette_from_img(&state, img, x, y, width, height);
+                }
+            }
+        } else if (Collect) {
+            if ((Mouse.button == Mouse_Button1 || Mouse.button == Mouse_Button3) && !Mouse.released) {
+                add_pick(&state, img, Mouse.x, Mouse.y);
+            }
+
+            if (Keyboard.key == XK_u || Keyboard.key == XK_BackSpace) undo_pick(&state);
+            if (Keyboard.key == XK_Return || Keyboard.key == XK_q) WindowShouldClose = 1;
+        } else {
+            if (Mouse.button == Mouse_Button1) {
+                WindowShouldClose = 1;
+                print_hex_from_img(&state, img, Mouse.x, Mouse.y);
+            }
+
+            if (Mouse.button == Mouse_Button3) {
+                WindowShouldClose = 1;
+                print_rgb_from_img(&state, img, Mouse.x, Mouse.y);
+            }
+        }
+
+        int repainted = end_drawing(&state);
+        if (Selection.active && (repainted > 0 || Mouse.moved)) draw_selection(&state);
+        if (repainted > 0 || Loupe.dirty) draw_loupe(&state, img);
     }
 
-    free_image(img);
+    if (Collect && !Stream) print_picks();
+    free(Picks.items);
+
+    free_loupe(&state);
+    free_image(&state, img);
     close_window(&state);
     return 0;
 }
@@ -7,6 +7,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 
 #define PROJECT_NAME "ctimer"
 #define PROJECT_VERSION "Version: 0.1"
@@ -23,8 +34,18 @@ const char *help_message = "Timer and Stopwatch writtern in C.\n\n"
 "Options:\n"
 "   -d --d-beep             Duration of beep for Timer in seconds (default: 1)\n"
 "   -n --no-beep            Disable beep for Timer\n"
+"   -r --refresh            Refresh rate in Hz, shows tenths of a second when above 1\n"
+"                           (default: 1)\n"
+"   -b --bench              Run the tick loop headless for given number of ticks\n"
+"                           and report wakeup jitter for each scheduler variant\n"
 "   -h --help               Print help\n"
-"   -v --version            Print version\n\n"
+"   -v --version            Print version\n"
+"Keys:\n"
+"   Space p     Pause or resume\n"
+"   l Enter     Record lap\n"
+"   + =         Add one minute\n"
+"   -           Subtract one minute\n"
+"   q           Quit\n\n"
 PROJECT_VERSION
 " | SPDX-License-Identifier: MIT (https://spdx.org/licenses/MIT)\n";
 
@@ -176,11 +197,461 @@ int beep(int freq, int ms) {
 #endif
 //===============================================================================
 
+/*******************************************************************************
+ * Frame renderer
+ *
+ * A frame is laid out as a row of cells in a preallocated buffer and compared
+ * with the previous frame. Only the cells that changed are sent to the
+ * terminal, and the whole update goes out with a single write().
+ *******************************************************************************/
+
+#define RENDER_MAX_CELLS 128
+#define RENDER_OUT_SIZE (RENDER_MAX_CELLS * 16)
+
+typedef struct {
+    char bytes[4];
+    unsigned char len;
+} Render_Cell;
+
+typedef struct {
+    Render_Cell cells[RENDER_MAX_CELLS];
+    Render_Cell prev[RENDER_MAX_CELLS];
+    int len;
+    int prev_len;
+    int has_prev;
+    int cursor;
+    char out[RENDER_OUT_SIZE];
+    size_t out_len;
+} Render_State;
+
+static Render_State Render;
+
+void render_write(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+void render_out(Render_State *r, const char *bytes, size_t len) {
+    if (r->out_len + len > RENDER_OUT_SIZE) return;
+    memcpy(r->out + r->out_len, bytes, len);
+    r->out_len += len;
+}
+
+void render_move(Render_State *r, int column) {
+    char seq[16];
+    int n = snprintf(seq, sizeof(seq), "\x1b[%dG", column + 1);
+    render_out(r, seq, n);
+    r->cursor = column;
+}
+
+void render_begin(Render_State *r) {
+    r->len = 0;
+}
+
+void render_glyph(Render_State *r, const char *glyph) {
+    size_t len = strlen(glyph);
+    if (r->len >= RENDER_MAX_CELLS || len > sizeof(r->cells[0].bytes)) return;
+
+    Render_Cell *cell = &r->cells[r->len++];
+    memcpy(cell->bytes, glyph, len);
+    cell->len = len;
+}
+
+void render_text(Render_State *r, const char *fmt, ...) {
+    char text[RENDER_MAX_CELLS + 1];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+
+    for (char *c = text; *c && r->len < RENDER_MAX_CELLS; c++) {
+        Render_Cell *cell = &r->cells[r->len++];
+        cell->bytes[0] = *c;
+        cell->len = 1;
+    }
+}
+
+void render_end(Render_State *r) {
+    r->out_len = 0;
+    int full = !r->has_prev;
+    if (full) {
+        render_out(r, "\r", 1);
+        r->cursor = 0;
+    }
+
+    for (int i = 0; i < r->len; i++) {
+        Render_Cell *cell = &r->cells[i];
+        Render_Cell *prev = &r->prev[i];
+        if (
+            !full && i < r->prev_len && cell->len == prev->len &&
+            memcmp(cell->bytes, prev->bytes, cell->len) == 0
+        ) continue;
+
+        if (r->cursor != i) render_move(r, i);
+        render_out(r, cell->bytes, cell->len);
+        r->cursor = i + 1;
+    }
+    if (full || r->len < r->prev_len) {
+        if (r->cursor != r->len) render_move(r, r->len);
+        render_out(r, "\x1b[K", 3);
+    }
+
+    if (r->out_len > 0) render_write(r->out, r->out_len);
+
+    memcpy(r->prev, r->cells, r->len * sizeof(Render_Cell));
+    r->prev_len = r->len;
+    r->has_prev = 1;
+}
+
+// Ends the current line, the next frame is drawn in full on a new line.
+void render_newline(Render_State *r) {
+    render_write("\n", 1);
+    r->has_prev = 0;
+    r->prev_len = 0;
+}
+
+// Forgets the previous frame, the next frame is redrawn in full over the
+// current line, e.g. after the terminal was resized.
+void render_invalidate(Render_State *r) {
+    r->has_prev = 0;
+}
+
+//===============================================================================
+
+#define NSEC_PER_SEC 1000000000ULL
+
+unsigned long long clock_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void clock_sleep_until_ns(unsigned long long deadline) {
+    struct timespec ts = {
+        .tv_sec = deadline / NSEC_PER_SEC,
+        .tv_nsec = deadline % NSEC_PER_SEC,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+
+/*******************************************************************************
+ * Timer state
+ *
+ * Elapsed time is measured on the monotonic clock, so pausing, resizing and
+ * key presses never skew it. Ticks only decide when a frame is drawn.
+ *******************************************************************************/
+
+typedef struct {
+    unsigned long long max_time;
+    unsigned long long period;
+    unsigned long long elapsed;
+    unsigned long long resumed_at;
+    unsigned long long last_lap;
+    unsigned int laps;
+    int running;
+    int tenths;
+    int columns;
+} Timer_State;
+
+static Timer_State Timer;
+
+unsigned long long timer_elapsed(Timer_State *t) {
+    if (!t->running) return t->elapsed;
+    return t->elapsed + (clock_now_ns() - t->resumed_at);
+}
+
+// Moves the running time into `elapsed`, so it can be adjusted directly.
+void timer_fold(Timer_State *t) {
+    unsigned long long now = clock_now_ns();
+    if (t->running) t->elapsed += now - t->resumed_at;
+    t->resumed_at = now;
+}
+
+// Moves a stopwatch by `delta`, or the end of a countdown. A countdown
+// with less than `-delta` left is kept as it is rather than finished.
+void timer_add(Timer_State *t, long long delta) {
+    timer_fold(t);
+    if (t->max_time == 0) {
+        if (delta < 0 && (unsigned long long)-delta > t->elapsed) t->elapsed = 0;
+        else t->elapsed += delta;
+    } else if (delta >= 0 || (t->elapsed < t->max_time && t->max_time - t->elapsed > (unsigned long long)-delta)) {
+        t->max_time += delta;
+    }
+}
+
+// Arms `timer_fd` for the next period boundary of the elapsed time, or
+// disarms it while paused so the process sleeps until the next key press.
+void timer_arm(Timer_State *t, int timer_fd) {
+    struct itimerspec spec = {0};
+    if (t->running) {
+        unsigned long long now = clock_now_ns();
+        unsigned long long elapsed = t->elapsed + (now - t->resumed_at);
+        unsigned long long next = now + (t->period - elapsed % t->period);
+
+        spec.it_value.tv_sec = next / NSEC_PER_SEC;
+        spec.it_value.tv_nsec = next % NSEC_PER_SEC;
+        spec.it_interval.tv_sec = t->period / NSEC_PER_SEC;
+        spec.it_interval.tv_nsec = t->period % NSEC_PER_SEC;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        perror("Error: couldn't arm timer");
+        exit(1);
+    }
+}
+
+void timer_update_columns(Timer_State *t) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        t->columns = ws.ws_col;
+    } else {
+        t->columns = RENDER_MAX_CELLS;
+    }
+}
+
+void draw_time(Render_State *r, unsigned long long elapsed, int tenths) {
+    unsigned long long second = elapsed / NSEC_PER_SEC;
+
+    render_text(r, "%02llu:%02llu:%02llu",
+        second / (60*60), (second / 60) % 60, second % 60
+    );
+    if (tenths) render_text(r, ".%llu", (elapsed / (NSEC_PER_SEC/10)) % 10);
+}
+
+// Draws the current frame and returns 1 once the Timer has run out.
+int draw_timer(Timer_State *t, Render_State *r) {
+    unsigned long long time = timer_elapsed(t);
+    int finished = 0;
+
+    render_begin(r);
+    if (t->max_time == 0) {
+        render_text(r, "Stopwatch: ");
+        draw_time(r, time, t->tenths);
+    } else {
+        if (time >= t->max_time) {
+            time = t->max_time;
+            finished = 1;
+        }
+
+        render_text(r, "Timer: ");
+        draw_time(r, time, t->tenths);
+        render_text(r, " ");
+
+        // Keep the line one column short of the edge to avoid autowrap.
+        int bar = t->columns - r->len - 5 - 1;
+        if (bar > 50) bar = 50;
+        if (bar < 0) bar = 0;
+
+        int filled = t->max_time ? (int)((time*bar)/t->max_time) : bar;
+        int i = 0;
+        for (; i < filled; i++) render_glyph(r, "█");
+        for (; i < bar; i++) render_glyph(r, "░");
+        render_text(r, " %2llu%%", t->max_time ? (time*100)/t->max_time : 100);
+    }
+    if (!t->running) render_text(r, " [paused]");
+    render_end(r);
+
+    return finished;
+}
+
+void draw_lap(Timer_State *t, Render_State *r) {
+    unsigned long long time = timer_elapsed(t);
+
+    render_begin(r);
+    render_text(r, "Lap %u: ", ++t->laps);
+    draw_time(r, time, t->tenths);
+    render_text(r, " (+");
+    draw_time(r, time - t->last_lap, t->tenths);
+    render_text(r, ")");
+    render_end(r);
+    render_newline(r);
+
+    t->last_lap = time;
+}
+
+/*******************************************************************************
+ * Benchmark
+ *
+ * Runs the tick loop headless and records how late each wakeup is against
+ * its deadline, for every combination of sleep method, timer slack and
+ * scheduling policy.
+ *******************************************************************************/
+
+typedef enum {
+    BENCH_SLEEP,
+    BENCH_CLOCK_NANOSLEEP,
+    BENCH_TIMERFD,
+    BENCH_METHOD_COUNT
+} Bench_Method;
+
+static const char *Bench_Method_Names[BENCH_METHOD_COUNT] = {
+    "nanosleep", "clock_nanosleep", "timerfd"
+};
+
+int bench_cmp(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Fills `jitter` with the lateness of every tick and returns the drift of
+// the last wakeup from where it should be after `ticks` periods.
+long long bench_run(
+    Bench_Method method, unsigned long long period,
+    long long *jitter, unsigned int ticks
+) {
+    int timer_fd = -1;
+    unsigned long long start = clock_now_ns();
+    unsigned long long wake = start;
+
+    if (method == BENCH_TIMERFD) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        unsigned long long first = start + period;
+        struct itimerspec spec = {
+            .it_value = { first / NSEC_PER_SEC, first % NSEC_PER_SEC },
+            .it_interval = { period / NSEC_PER_SEC, period % NSEC_PER_SEC },
+        };
+        if (timer_fd < 0 || timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+            perror("Error: couldn't arm timer");
+            exit(1);
+        }
+    }
+
+    for (unsigned int tick = 1; tick <= ticks; tick++) {
+        // The plain sleep has no notion of the schedule, it aims for one
+        // period after its own wakeup, like `sleep(1)` in a loop does.
+        unsigned long long target = start + tick * period;
+
+        switch (method) {
+            case BENCH_SLEEP: {
+                target = wake + period;
+                struct timespec ts = { period / NSEC_PER_SEC, period % NSEC_PER_SEC };
+                while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+                break;
+            }
+            case BENCH_CLOCK_NANOSLEEP: {
+                clock_sleep_until_ns(target);
+                break;
+            }
+            case BENCH_TIMERFD: {
+                unsigned long long expirations;
+                while (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+                break;
+            }
+            default: break;
+        }
+
+        wake = clock_now_ns();
+        jitter[tick-1] = (long long)(wake - target);
+    }
+
+    if (timer_fd >= 0) close(timer_fd);
+    return (long long)(wake - (start + ticks * period));
+}
+
+void bench_report(
+    const char *method, const char *slack, const char *policy,
+    long long *jitter, unsigned int ticks, long long drift
+) {
+    qsort(jitter, ticks, sizeof(*jitter), bench_cmp);
+    // Nearest rank, ceil(0.99 * ticks) - 1, in size_t so it can't overflow.
+    size_t p99 = ((size_t)ticks * 99 + 99) / 100 - 1;
+
+    printf("%-16s %-8s %-10s %10.1f %10.1f %10.1f %10.1f %12.1f\n",
+        method, slack, policy,
+        jitter[0] / 1e3, jitter[ticks/2] / 1e3, jitter[p99] / 1e3,
+        jitter[ticks-1] / 1e3, drift / 1e3
+    );
+    fflush(stdout);
+}
+
+int bench(unsigned int ticks, unsigned long long period) {
+    long long *jitter = malloc(ticks * sizeof(*jitter));
+    if (jitter == NULL) {
+        fprintf(stderr, "Error: couldn't allocate memory for %u ticks.\n", ticks);
+        exit(1);
+    }
+
+    int default_slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+    struct sched_param fifo_param = { .sched_priority = sched_get_priority_min(SCHED_FIFO) };
+    struct sched_param other_param = { .sched_priority = 0 };
+
+    printf("Benchmark: %u ticks every %llu ns, default timer slack %d ns\n",
+        ticks, period, default_slack
+    );
+    printf("%-16s %-8s %-10s %10s %10s %10s %10s %12s\n",
+        "method", "slack", "policy", "min us", "median us", "p99 us", "max us", "drift us"
+    );
+
+    for (int fifo = 0; fifo <= 1; fifo++) {
+        if (fifo && sched_setscheduler(0, SCHED_FIFO, &fifo_param) < 0) {
+            printf("SCHED_FIFO skipped: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int slack = 0; slack <= 1; slack++) {
+            prctl(PR_SET_TIMERSLACK, slack ? 1 : default_slack, 0, 0, 0);
+
+            for (int method = 0; method < BENCH_METHOD_COUNT; method++) {
+                long long drift = bench_run(method, period, jitter, ticks);
+                bench_report(
+                    Bench_Method_Names[method],
+                    slack ? "1ns" : "default",
+                    fifo ? "SCHED_FIFO" : "SCHED_OTHER",
+                    jitter, ticks, drift
+                );
+            }
+        }
+        prctl(PR_SET_TIMERSLACK, default_slack, 0, 0, 0);
+    }
+
+    sched_setscheduler(0, SCHED_OTHER, &other_param);
+    free(jitter);
+    return 0;
+}
+
+//===============================================================================
+
+static struct termios Term_Saved;
+static int Term_Raw = 0;
+
+void term_restore(void) {
+    if (Term_Raw) tcsetattr(STDIN_FILENO, TCSAFLUSH, &Term_Saved);
+    Term_Raw = 0;
+}
+
+// Turns off line buffering and echo on stdin, so keys arrive as they are
+// pressed. Ctrl-C still raises SIGINT, which is read through the signalfd.
+void term_raw_mode(void) {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &Term_Saved) < 0) return;
+
+    struct termios raw = Term_Saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) < 0) return;
+
+    Term_Raw = 1;
+    atexit(term_restore);
+}
+
+int epoll_add(int epoll_fd, int fd) {
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
 int main(int argc, char *argv[]) {
-    unsigned int hour = 0, minute = 0, second = 0, time = 0;
-    unsigned int max_hour = 0, max_minute = 0, max_second = 0, max_time = 0;
+    unsigned int max_hour = 0, max_minute = 0, max_second = 0;
     char on_beep = 1;
     int d_beep = 1;
+    int refresh = 1;
+    int bench_ticks = 0;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             printf(help_message);
@@ -210,6 +681,46 @@ int main(int argc, char *argv[]) {
                 exit(1);
             }
 
+            i++;
+            continue;
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--refresh") == 0) {
+            if (argv[i+1] == NULL) {
+                fprintf(
+                    stderr, "Error: `%s` requires integer value. No value is given.\n\n%s",
+                    argv[i], help_message
+                );
+                exit(1);
+            }
+
+            refresh = atoi(argv[i+1]);
+            if (refresh <= 0 || refresh > 1000) {
+                fprintf(
+                    stderr, "Error: `%s` only supports values from 1 to 1000. Given value: %s\n\n%s",
+                    argv[i], argv[i+1], help_message
+                );
+                exit(1);
+            }
+
+            i++;
+            continue;
+        } else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--bench") == 0) {
+            if (argv[i+1] == NULL) {
+                fprintf(
+                    stderr, "Error: `%s` requires integer value. No value is given.\n\n%s",
+                    argv[i], help_message
+                );
+                exit(1);
+            }
+
+            bench_ticks = atoi(argv[i+1]);
+            if (bench_ticks <= 0) {
+                fprintf(
+                    stderr, "Error: `%s` only supports positive integer values. Given value: %s\n\n%s",
+                    argv[i], argv[i+1], help_message
+                );
+                exit(1);
+            }
+
             i++;
             continue;
         } else if (argv[i][0] == '-') {
@@ -231,38 +742,116 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    max_time = (max_hour*60*60) + (max_minute*60) + max_second;
-    while(1) {
-        time = (hour*60*60) + (minute*60) + second;
+    if (bench_ticks) return bench(bench_ticks, NSEC_PER_SEC / refresh);
 
-        if (max_time == 0) {
-            printf("\rStopwatch: %02d:%02d:%02d", hour, minute, second);
-        } else {
-            unsigned int progress = (time*100)/max_time;
-            unsigned int i = 0;
+    Timer.max_time =
+        ((max_hour*60*60) + (max_minute*60) + max_second) * NSEC_PER_SEC;
+    Timer.period = NSEC_PER_SEC / refresh;
+    Timer.tenths = refresh > 1;
+    timer_update_columns(&Timer);
 
-            printf("\rTimer: %02d:%02d:%02d ", hour, minute, second);
-            for (; i < progress/2; i++) printf("█");
-            for (; i < 50; i++) printf("░");
-            printf(" %2d%%", (time*100)/max_time);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
 
-            if (time == max_time) {
-                printf("\n");
-                if (on_beep) beep(10, d_beep*1000);
-                break;
-            }
-        }
-        fflush(stdout);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || timer_fd < 0 || epoll_fd < 0) {
+        perror("Error: couldn't set up event loop");
+        exit(1);
+    }
+    if (epoll_add(epoll_fd, signal_fd) < 0 || epoll_add(epoll_fd, timer_fd) < 0) {
+        perror("Error: couldn't watch file descriptor");
+        exit(1);
+    }
+    // Regular files and /dev/null can't be watched, run without keys then.
+    epoll_add(epoll_fd, STDIN_FILENO);
+
+    term_raw_mode();
+
+    Timer.running = 1;
+    Timer.resumed_at = clock_now_ns();
+    timer_arm(&Timer, timer_fd);
 
-        second++;
-        if (second == 60) {
-           minute += 1;
-           second = 0;
+    int finished = draw_timer(&Timer, &Render);
+    int quit = 0;
+    while (!finished && !quit) {
+        struct epoll_event events[4];
+        int count = epoll_wait(epoll_fd, events, 4, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("Error: couldn't wait for events");
+            exit(1);
         }
-        if(minute == 60) {
-            hour += 1;
-            minute = 0;
+
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == timer_fd) {
+                unsigned long long expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0) continue;
+            } else if (fd == signal_fd) {
+                struct signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) continue;
+
+                if (info.ssi_signo == SIGWINCH) {
+                    timer_update_columns(&Timer);
+                    render_invalidate(&Render);
+                } else {
+                    quit = 1;
+                }
+            } else if (fd == STDIN_FILENO) {
+                char keys[32];
+                ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+                if (n <= 0) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                    continue;
+                }
+
+                for (ssize_t k = 0; k < n; k++) {
+                    switch (keys[k]) {
+                        case ' ':
+                        case 'p': {
+                            timer_fold(&Timer);
+                            Timer.running = !Timer.running;
+                            timer_arm(&Timer, timer_fd);
+                            break;
+                        }
+                        case 'l':
+                        case '\n':
+                        case '\r': {
+                            draw_lap(&Timer, &Render);
+                            break;
+                        }
+                        case '+':
+                        case '=': {
+                            timer_add(&Timer, 60 * NSEC_PER_SEC);
+                            timer_arm(&Timer, timer_fd);
+                            break;
+                        }
+                        case '-': {
+                            timer_add(&Timer, -60 * (long long)NSEC_PER_SEC);
+                            timer_arm(&Timer, timer_fd);
+                            break;
+                        }
+                        case 'q': {
+                            quit = 1;
+                            break;
+                        }
+                    }
+                }
+            }
         }
-        sleep(1);
+
+        if (!quit) finished = draw_timer(&Timer, &Render);
     }
+    render_newline(&Render);
+    term_restore();
+
+    if (finished && on_beep) beep(10, d_beep*1000);
+    return 0;
 }
@@ -1,14 +1,46 @@
 /********************************************************************************
  * `opml_feed_link`: It extracts link from opml file and prints it in output file.
  * Usage:
- *      opml_feed_link <opml_file> <output_file>
+ *      opml_feed_link <opml_file>... <output_file>
+ *      opml_feed_link --check [--jobs N] [--per-host N] [--timeout SECONDS] <opml_file>
+ *      opml_feed_link --bench [--sizes N,...] [--runs N] [--format text|csv]
+ * The OPML files are parsed in parallel and their feeds merged: URLs that
+ * only differ in scheme or host case, a default port or trailing slashes
+ * are the same feed.
+ * Every `xmlUrl` of an `<outline>` is written as a list item in the section
+ * of its category: outlines without an `xmlUrl` that hold others are
+ * categories, their `text` is the heading. Top level categories are `##`
+ * headings, nested ones go a level down each, feeds outside of any category
+ * go under `## Podcast`. A section's list replaces its body up to the next
+ * heading, missing sections are added at the end of their parent, or of
+ * the file. Section bodies written here start with a
+ * `<!-- opml_feed_link -->` line: sections left without feeds are emptied,
+ * and so are marked ones whose category is gone. All sections are
+ * updated in one write, the ones whose feeds didn't change are kept byte
+ * for byte and so is the rest of the file.
+ * Each list is sorted by host, then by URL.
+ * The file is replaced atomically and left alone when nothing changed.
+ * Attributes may come in any order, use either quote and span lines,
+ * entities are decoded.
+ * `--check` sends a HEAD request to every feed, many at a time, and prints
+ * its status, latency and redirect target. https feeds need a build with
+ * `-DOPML_TLS -lssl -lcrypto`, it's Linux only.
+ * `--bench` generates OPML files of 1k to 1M feeds (`--sizes`) in TMPDIR and
+ * prints the best of `--runs` for extracting the feeds, the matcher this
+ * tool started with, rewriting the sections and finding them up to date,
+ * in MB/s and outlines/s. Feeds that are missed, or URLs and categories
+ * that are wrong, make a stage FAIL; the old matcher is expected to. It
+ * exits with 2 when the parser or the rewrite fails.
  * Compile:
- *      GCC: cc opml_feed_link.c -o opml_feed_link
- *      Clang: cl opml_feed_link.c -o opml_feed_link
- *      tcc: tcc opml_feed_link.c -o opml_feed_link
- *      MSVC: cl opml_feed_link.c -O:opml_feed_link
+ *      GCC: cc opml_feed_link.c -pthread -o opml_feed_link
+ *      GCC (with https checks): cc -DOPML_TLS opml_feed_link.c -lssl -lcrypto -pthread -o opml_feed_link
+ *      Clang: clang opml_feed_link.c -pthread -o opml_feed_link
+ *      tcc: tcc opml_feed_link.c -pthread -o opml_feed_link
+ *      MSVC (no --check or --bench, one thread): cl opml_feed_link.c /Fe:opml_feed_link
  * Run:
- *      ./opml_feed_link <opml-filename>
+ *      ./opml_feed_link subscriptions.opml more.opml README.md
+ *      ./opml_feed_link --check --jobs 32 subscriptions.opml
+ *      ./opml_feed_link --bench --sizes 1000,100000
  * ------------------------------------------------------------------------------
  * MIT License
  *
@@ -37,66 +69,2363 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 
-#define MAX_LINE_LENGTH 450
+#ifndef _WIN32
+#   include <fcntl.h>
+#   include <limits.h>
+#   include <time.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <sys/uio.h>
+#   include <pthread.h>
+#endif // _WIN32
 
-int main(int argc, char *argv[]) {
-    FILE *output_file = fopen(argv[2], "r+");
-    if (output_file == NULL) {
-        perror("Error: couldn't opening output file.");
+#ifdef __linux__
+#   include <errno.h>
+#   include <strings.h>
+#   include <netdb.h>
+#   include <arpa/inet.h>
+#   include <sys/epoll.h>
+#   include <sys/socket.h>
+#   define OPML_CHECK
+#endif // __linux__
+
+#ifdef OPML_TLS
+#   include <openssl/ssl.h>
+#   include <openssl/err.h>
+#   include <openssl/x509v3.h>
+#endif // OPML_TLS
+
+#define MAX_ATTRIBUTES 32
+#define MAX_PARSE_THREADS 16
+// Category paths join the names of nested categories with this.
+#define CATEGORY_SEPARATOR '\x1f'
+// Deeper categories go in their ancestor at this depth, `######` is the
+// last heading level.
+#define MAX_CATEGORY_DEPTH 5
+#define DEFAULT_CATEGORY "Podcast"
+// First line of every section body written here, only those are emptied
+// when their category is gone.
+#define SECTION_MARKER "<!-- opml_feed_link -->"
+
+#ifndef IOV_MAX
+#   define IOV_MAX 1024
+#endif // IOV_MAX
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} Buffer;
+
+typedef struct {
+    const char *data;
+    size_t len;
+} Slice;
+
+typedef struct {
+    // `url` as written in the OPML, then its normalized form.
+    char *url;
+    char *key;
+    size_t key_len;
+    // Where the host starts in `key`, feeds sort from there.
+    size_t host_start;
+    unsigned long long hash;
+    // Interned path of the categories it's in.
+    const char *category;
+} Feed;
+
+// Open addressing set of feeds keyed by the normalized URL, with linear
+// probing. `slots` hold indices into `feeds` plus one, 0 is empty.
+typedef struct {
+    Feed *feeds;
+    size_t count;
+    size_t capacity;
+    size_t *slots;
+    size_t slot_count;
+} Feed_Set;
+
+// Interned category paths, with an open addressing index like Feed_Set's.
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+    size_t *slots;
+    size_t slot_count;
+} Category_List;
+
+typedef struct {
+    const char *path;
+    Feed_Set feeds;
+    Category_List categories;
+    int ok;
+} Opml_Input;
+
+// A markdown heading of the output file. Its path is made like category
+// paths from the enclosing headings, down from level 2.
+typedef struct {
+    char *path;
+    int level;
+    size_t body_start;
+    // The body ends at the next heading, the subtree at the next one of
+    // the same or a higher level.
+    size_t body_end;
+    size_t subtree_end;
+} Doc_Section;
+
+// A section to write, with the range of its list in the links buffer.
+typedef struct {
+    char *path;
+    size_t links_start;
+    size_t links_end;
+} Section_Target;
+
+// Replaces [start, end) of the output file with `text_len` bytes of the
+// text buffer, an insertion when `start == end`. The heading's name is in
+// the text buffer too, its list in the links buffer.
+typedef struct {
+    size_t start;
+    size_t end;
+    int insert;
+    size_t text_start;
+    size_t text_len;
+    size_t name_start;
+    size_t name_len;
+    int level;
+    size_t links_start;
+    size_t links_end;
+    // Planning order, among edits at the same place.
+    size_t order;
+} Section_Edit;
+
+typedef struct {
+    char *data;
+    size_t size;
+    int mapped;
+} Mapped_File;
+
+typedef struct {
+    const char *name;
+    size_t name_len;
+    // Raw value between the quotes, entities aren't decoded yet.
+    const char *value;
+    size_t value_len;
+} Xml_Attribute;
+
+typedef struct {
+    Xml_Attribute attributes[MAX_ATTRIBUTES];
+    int attribute_count;
+    // `<outline/>`, no `</outline>` follows.
+    int self_closing;
+} Outline;
+
+typedef enum {
+    OPML_END,
+    OPML_OUTLINE,
+    OPML_OUTLINE_END
+} Opml_Token;
+
+typedef struct {
+    const char *cursor;
+    const char *end;
+} Opml_Tokenizer;
+
+// Maps the whole file read-only, or reads it where there's no mmap.
+int map_file(const char *path, Mapped_File *file) {
+    memset(file, 0, sizeof(*file));
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return 0;
+    }
+    file->size = st.st_size;
+    if (file->size == 0) {
+        close(fd);
         return 1;
     }
 
-    FILE *temp_file = tmpfile();
-    if (temp_file == NULL) {
-        perror("Error: couldn't opening temp file.");
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->data == MAP_FAILED) {
+        file->data = NULL;
+        return 0;
+    }
+    file->mapped = 1;
+    madvise(file->data, file->size, MADV_SEQUENTIAL);
+    return 1;
+#else
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return 0;
+
+    fseek(fp, 0, SEEK_END);
+    file->size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    file->data = malloc(file->size + 1);
+    if (file->data == NULL || fread(file->data, 1, file->size, fp) != file->size) {
+        free(file->data);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    return 1;
+#endif // _WIN32
+}
+
+void unmap_file(Mapped_File *file) {
+#ifndef _WIN32
+    if (file->mapped) {
+        munmap(file->data, file->size);
+        return;
+    }
+#endif // _WIN32
+    free(file->data);
+}
+
+int is_xml_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+const char *skip_xml_space(const char *p, const char *end) {
+    while (p < end && is_xml_space(*p)) p++;
+    return p;
+}
+
+// Returns the first byte after `needle` in [p, end), or NULL.
+const char *skip_past(const char *p, const char *end, const char *needle) {
+    size_t len = strlen(needle);
+    while (p < end) {
+        p = memchr(p, needle[0], end - p);
+        if (p == NULL || (size_t)(end - p) < len) return NULL;
+        if (memcmp(p, needle, len) == 0) return p + len;
+        p++;
+    }
+    return NULL;
+}
+
+// Parses the attributes of the tag `p` points into, up to and including
+// its `>`. Returns the byte after the tag, or NULL when the tag is cut off.
+const char *parse_attributes(const char *p, const char *end, Outline *outline) {
+    outline->attribute_count = 0;
+    outline->self_closing = 0;
+
+    while (1) {
+        p = skip_xml_space(p, end);
+        if (p >= end) return NULL;
+        if (*p == '>') return p + 1;
+        if (*p == '/') {
+            outline->self_closing = 1;
+            p++;
+            continue;
+        }
+
+        const char *name = p;
+        while (p < end && !is_xml_space(*p) && *p != '=' && *p != '>' && *p != '/') p++;
+        size_t name_len = p - name;
+        p = skip_xml_space(p, end);
+        if (p >= end) return NULL;
+        if (*p != '=') {
+            // Attribute without a value, not XML but seen in the wild.
+            if (name_len == 0) p++;
+            continue;
+        }
+
+        p = skip_xml_space(p + 1, end);
+        if (p >= end) return NULL;
+        char quote = *p;
+        if (quote != '"' && quote != '\'') continue;
+
+        const char *value = p + 1;
+        const char *close = memchr(value, quote, end - value);
+        if (close == NULL) return NULL;
+        p = close + 1;
+
+        if (outline->attribute_count < MAX_ATTRIBUTES) {
+            Xml_Attribute *attribute = &outline->attributes[outline->attribute_count++];
+            attribute->name = name;
+            attribute->name_len = name_len;
+            attribute->value = value;
+            attribute->value_len = close - value;
+        }
+    }
+}
+
+// Moves to the next `<outline>` or `</outline>` tag, skipping comments,
+// CDATA and processing instructions. `outline` is only filled for the
+// opening tag.
+Opml_Token opml_next_outline(Opml_Tokenizer *tokenizer, Outline *outline) {
+    const char *p = tokenizer->cursor;
+    const char *end = tokenizer->end;
+
+    while (p < end) {
+        p = memchr(p, '<', end - p);
+        if (p == NULL) break;
+        size_t left = end - p;
+
+        if (left >= 4 && memcmp(p, "<!--", 4) == 0) {
+            p = skip_past(p + 4, end, "-->");
+        } else if (left >= 9 && memcmp(p, "<![CDATA[", 9) == 0) {
+            p = skip_past(p + 9, end, "]]>");
+        } else if (left >= 2 && p[1] == '?') {
+            p = skip_past(p + 2, end, "?>");
+        } else if (left > 8 && memcmp(p + 1, "outline", 7) == 0 &&
+                   (is_xml_space(p[8]) || p[8] == '>' || p[8] == '/')) {
+            const char *next = parse_attributes(p + 8, end, outline);
+            tokenizer->cursor = next ? next : end;
+            if (next) return OPML_OUTLINE;
+            break;
+        } else if (left > 9 && p[1] == '/' && memcmp(p + 2, "outline", 7) == 0 &&
+                   (is_xml_space(p[9]) || p[9] == '>')) {
+            const char *close = memchr(p + 9, '>', end - p - 9);
+            if (close == NULL) break;
+            tokenizer->cursor = close + 1;
+            return OPML_OUTLINE_END;
+        } else {
+            p++;
+        }
+        if (p == NULL) break;
+    }
+
+    tokenizer->cursor = end;
+    return OPML_END;
+}
+
+const Xml_Attribute *outline_attribute(const Outline *outline, const char *name) {
+    size_t len = strlen(name);
+    for (int i = 0; i < outline->attribute_count; i++) {
+        const Xml_Attribute *attribute = &outline->attributes[i];
+        if (attribute->name_len == len && memcmp(attribute->name, name, len) == 0) {
+            return attribute;
+        }
+    }
+    return NULL;
+}
+
+size_t encode_utf8(unsigned long code, char *dst) {
+    if (code < 0x80) {
+        dst[0] = code;
         return 1;
     }
+    if (code < 0x800) {
+        dst[0] = 0xc0 | (code >> 6);
+        dst[1] = 0x80 | (code & 0x3f);
+        return 2;
+    }
+    if (code < 0x10000) {
+        dst[0] = 0xe0 | (code >> 12);
+        dst[1] = 0x80 | ((code >> 6) & 0x3f);
+        dst[2] = 0x80 | (code & 0x3f);
+        return 3;
+    }
+    dst[0] = 0xf0 | (code >> 18);
+    dst[1] = 0x80 | ((code >> 12) & 0x3f);
+    dst[2] = 0x80 | ((code >> 6) & 0x3f);
+    dst[3] = 0x80 | (code & 0x3f);
+    return 4;
+}
+
+// Decodes the predefined and numeric entities of `src` into `dst`, which
+// needs `len` bytes: no entity is shorter than what it decodes to.
+// Unknown entities are copied as they are.
+size_t xml_decode(const char *src, size_t len, char *dst) {
+    static const struct { const char *name; size_t len; char c; } entities[] = {
+        { "amp;", 4, '&' }, { "lt;", 3, '<' }, { "gt;", 3, '>' },
+        { "quot;", 5, '"' }, { "apos;", 5, '\'' },
+    };
+    const char *end = src + len;
+    char *out = dst;
+
+    while (src < end) {
+        const char *amp = memchr(src, '&', end - src);
+        if (amp == NULL) amp = end;
+        memcpy(out, src, amp - src);
+        out += amp - src;
+        src = amp;
+        if (src == end) break;
+
+        const char *p = src + 1;
+        size_t left = end - p;
+        int decoded = 0;
+
+        if (left > 1 && *p == '#') {
+            int hex = p[1] == 'x' || p[1] == 'X';
+            const char *digits = p + 1 + hex;
+            unsigned long code = 0;
+            const char *q = digits;
+            while (q < end && q - digits < 8) {
+                int d;
+                if (*q >= '0' && *q <= '9') d = *q - '0';
+                else if (hex && *q >= 'a' && *q <= 'f') d = *q - 'a' + 10;
+                else if (hex && *q >= 'A' && *q <= 'F') d = *q - 'A' + 10;
+                else break;
+                code = code * (hex ? 16 : 10) + d;
+                q++;
+            }
+            if (q > digits && q < end && *q == ';' && code > 0 && code <= 0x10ffff) {
+                out += encode_utf8(code, out);
+                src = q + 1;
+                decoded = 1;
+            }
+        } else {
+            for (size_t i = 0; i < sizeof(entities) / sizeof(entities[0]); i++) {
+                if (left >= entities[i].len && memcmp(p, entities[i].name, entities[i].len) == 0) {
+                    *out++ = entities[i].c;
+                    src = p + entities[i].len;
+                    decoded = 1;
+                    break;
+                }
+            }
+        }
+
+        if (!decoded) *out++ = *src++;
+    }
+    return out - dst;
+}
+
+void buffer_reserve(Buffer *buffer, size_t len) {
+    if (buffer->len + len <= buffer->capacity) return;
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->len + len) capacity *= 2;
+    buffer->data = realloc(buffer->data, capacity);
+    if (buffer->data == NULL) {
+        perror("Error: couldn't allocate buffer.");
+        exit(1);
+    }
+    buffer->capacity = capacity;
+}
+
+void buffer_append(Buffer *buffer, const char *data, size_t len) {
+    buffer_reserve(buffer, len);
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+// Level of the markdown heading the line at `p` starts with, or 0.
+int heading_level(const char *p, const char *end) {
+    int level = 0;
+    while (p + level < end && p[level] == '#') level++;
+    if (level == 0 || p + level >= end || (p[level] != ' ' && p[level] != '\n')) return 0;
+    return level;
+}
+
+// Lists the headings of levels 2 to 6. A level 1 heading starts over.
+Doc_Section *scan_sections(Slice doc, size_t *count) {
+    const char *end = doc.data + doc.len;
+    Doc_Section *sections = NULL;
+    size_t capacity = 0;
+    *count = 0;
+
+    Buffer path = {0};
+    // Length of the path down to each level, and the sections whose
+    // subtree is still open.
+    size_t level_len[7] = {0};
+    size_t open[7];
+    int open_count = 0;
+    int body_open = 0;
+
+    const char *line = doc.data;
+    while (line < end) {
+        const char *newline = memchr(line, '\n', end - line);
+        const char *next = newline ? newline + 1 : end;
+        int level = heading_level(line, end);
+        if (level == 0 || level > 6) {
+            line = next;
+            continue;
+        }
+
+        size_t start = line - doc.data;
+        if (body_open) sections[*count - 1].body_end = start;
+        while (open_count > 0 && sections[open[open_count - 1]].level >= level) {
+            sections[open[--open_count]].subtree_end = start;
+        }
+        body_open = 0;
+        if (level == 1) {
+            memset(level_len, 0, sizeof(level_len));
+            line = next;
+            continue;
+        }
 
-    char line[MAX_LINE_LENGTH];
+        const char *text = skip_xml_space(line + level, next);
+        const char *text_end = newline ? newline : end;
+        while (text_end > text && is_xml_space(text_end[-1])) text_end--;
+        path.len = level_len[level - 1];
+        char separator = CATEGORY_SEPARATOR;
+        if (path.len) buffer_append(&path, &separator, 1);
+        buffer_append(&path, text, text_end - text);
+        for (int i = level; i < 7; i++) level_len[i] = path.len;
 
-    while (fgets(line, MAX_LINE_LENGTH, output_file)) {
-        fprintf(temp_file, line);
+        if (*count == capacity) {
+            capacity = capacity ? 2 * capacity : 32;
+            sections = realloc(sections, capacity * sizeof(Doc_Section));
+            if (sections == NULL) {
+                perror("Error: couldn't allocate sections.");
+                exit(1);
+            }
+        }
+        Doc_Section *section = &sections[*count];
+        section->path = malloc(path.len + 1);
+        if (section->path == NULL) {
+            perror("Error: couldn't allocate sections.");
+            exit(1);
+        }
+        memcpy(section->path, path.data, path.len);
+        section->path[path.len] = 0;
+        section->level = level;
+        section->body_start = next - doc.data;
+        section->body_end = doc.len;
+        section->subtree_end = doc.len;
+        open[open_count++] = (*count)++;
+        body_open = 1;
+        line = next;
+    }
+
+    free(path.data);
+    return sections;
+}
+
+// Orders sections by path, the first in the file first.
+int compare_doc_sections(const void *a, const void *b) {
+    const Doc_Section *x = *(const Doc_Section **)a, *y = *(const Doc_Section **)b;
+    int result = strcmp(x->path, y->path);
+    return result ? result : (x > y) - (x < y);
+}
+
+// Binary search in sections sorted with compare_doc_sections.
+const Doc_Section *find_doc_section(const Doc_Section **sorted, size_t count, const char *path, size_t len) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const char *other = sorted[middle]->path;
+        int result = strncmp(other, path, len);
+        if (result == 0) result = other[len] != 0;
+        if (result < 0) low = middle + 1;
+        else high = middle;
+    }
+    if (low == count) return NULL;
+    const char *other = sorted[low]->path;
+    return strncmp(other, path, len) == 0 && other[len] == 0 ? sorted[low] : NULL;
+}
+
+// Writes `parts` to a temporary file next to `path` with one writev per
+// IOV_MAX parts, syncs it and renames it over `path`, keeping its
+// permissions and owner. A symlink is followed, the file it points to is
+// replaced.
+int splice_file(const char *path, const Slice *parts, int count) {
+#ifndef _WIN32
+    char *target = realpath(path, NULL);
+    if (target == NULL) return 0;
+    struct iovec *iov = malloc(count * sizeof(struct iovec));
+    size_t target_len = strlen(target);
+    char *temp_path = malloc(target_len + sizeof(".XXXXXX"));
+    if (iov == NULL || temp_path == NULL) {
+        free(target);
+        free(iov);
+        free(temp_path);
+        return 0;
+    }
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = (void *)parts[i].data;
+        iov[i].iov_len = parts[i].len;
+        total += parts[i].len;
+    }
+    memcpy(temp_path, target, target_len);
+    memcpy(temp_path + target_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int ok = 0;
+    int fd = mkstemp(temp_path);
+    if (fd >= 0) {
+        struct stat st;
+        if (stat(target, &st) == 0) {
+            fchmod(fd, st.st_mode & 07777);
+            // Only root or the owner's own files can keep it, that's fine.
+            if (fchown(fd, st.st_uid, st.st_gid) < 0) {}
+        }
+
+        // One call unless the kernel writes less, then carry on from there.
+        struct iovec *v = iov;
+        int left = count;
+        ok = 1;
+        while (ok && total > 0) {
+            ssize_t written = writev(fd, v, left < IOV_MAX ? left : IOV_MAX);
+            if (written < 0) {
+                ok = 0;
+                break;
+            }
+            total -= written;
+            while (left > 0 && (size_t)written >= v->iov_len) {
+                written -= v->iov_len;
+                v++;
+                left--;
+            }
+            if (left > 0) {
+                v->iov_base = (char *)v->iov_base + written;
+                v->iov_len -= written;
+            }
+        }
+
+        // The data has to be on disk before the rename is, or a crash can
+        // leave an empty file behind.
+        if (ok && fsync(fd) < 0) ok = 0;
+        if (close(fd) < 0) ok = 0;
+        if (ok && rename(temp_path, target) < 0) ok = 0;
+        if (!ok) unlink(temp_path);
+    }
+
+    free(iov);
+    free(temp_path);
+    free(target);
+    return ok;
+#else
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return 0;
+    for (int i = 0; i < count; i++) fwrite(parts[i].data, 1, parts[i].len, fp);
+    return fclose(fp) == 0;
+#endif // _WIN32
+}
+
+unsigned long long hash_bytes(const char *data, size_t len) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+char to_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
 
-        line[strcspn(line, "\n")] = 0;
-        if (strcmp(line, "## Podcast") == 0) {
-            fprintf(temp_file, "\n");
+// Writes the normalized form of `url` into `key`, which needs `len` bytes:
+// lowercase scheme and host, no default port, no fragment and no trailing
+// slashes on the path. Returns its length and where its host starts.
+size_t normalize_url(const char *url, size_t len, char *key, size_t *host_start) {
+    const char *end = url + len;
+    while (url < end && is_xml_space(*url)) url++;
+    while (end > url && is_xml_space(end[-1])) end--;
+    const char *fragment = memchr(url, '#', end - url);
+    if (fragment) end = fragment;
+
+    char *out = key;
+    *host_start = 0;
+    const char *scheme_end = NULL;
+    for (const char *p = url; p + 2 < end && *p != '/' && *p != '?'; p++) {
+        if (p[0] == ':' && p[1] == '/' && p[2] == '/') {
+            scheme_end = p;
             break;
         }
     }
+    if (scheme_end == NULL) {
+        memcpy(out, url, end - url);
+        return end - url;
+    }
+
+    for (const char *p = url; p < scheme_end; p++) *out++ = to_lower(*p);
+    size_t scheme_len = scheme_end - url;
+    memcpy(out, "://", 3);
+    out += 3;
+    *host_start = out - key;
+
+    const char *authority = scheme_end + 3;
+    const char *path = authority;
+    while (path < end && *path != '/' && *path != '?') path++;
+    const char *at = NULL;
+    for (const char *p = authority; p < path; p++) if (*p == '@') at = p;
+    if (at) {
+        memcpy(out, authority, at + 1 - authority);
+        out += at + 1 - authority;
+        authority = at + 1;
+    }
+
+    const char *port = NULL;
+    for (const char *p = path; p > authority; p--) {
+        if (p[-1] == ']') break;
+        if (p[-1] == ':') {
+            port = p - 1;
+            break;
+        }
+    }
+    const char *host_end = port ? port : path;
+    for (const char *p = authority; p < host_end; p++) *out++ = to_lower(*p);
+    if (port) {
+        size_t port_len = path - port;
+        int is_default = (scheme_len == 4 && port_len == 3 && memcmp(key, "http", 4) == 0 && memcmp(port, ":80", 3) == 0) ||
+                         (scheme_len == 5 && port_len == 4 && memcmp(key, "https", 5) == 0 && memcmp(port, ":443", 4) == 0);
+        if (!is_default && port_len > 1) {
+            memcpy(out, port, port_len);
+            out += port_len;
+        }
+    }
+
+    const char *query = memchr(path, '?', end - path);
+    const char *path_end = query ? query : end;
+    while (path_end > path && path_end[-1] == '/') path_end--;
+    memcpy(out, path, path_end - path);
+    out += path_end - path;
+    if (query) {
+        memcpy(out, query, end - query);
+        out += end - query;
+    }
+    return out - key;
+}
+
+void feed_set_grow(Feed_Set *set) {
+    size_t slot_count = set->slot_count ? 2 * set->slot_count : 1024;
+    size_t *slots = calloc(slot_count, sizeof(size_t));
+    if (slots == NULL) {
+        perror("Error: couldn't allocate feed set.");
+        exit(1);
+    }
+    for (size_t i = 0; i < set->count; i++) {
+        size_t slot = set->feeds[i].hash & (slot_count - 1);
+        while (slots[slot]) slot = (slot + 1) & (slot_count - 1);
+        slots[slot] = i + 1;
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->slot_count = slot_count;
+}
+
+// Slot of the feed with `key`, or the empty slot it would go in.
+size_t feed_set_slot(const Feed_Set *set, const char *key, size_t key_len, unsigned long long hash) {
+    size_t slot = hash & (set->slot_count - 1);
+    while (set->slots[slot]) {
+        const Feed *other = &set->feeds[set->slots[slot] - 1];
+        if (other->hash == hash && other->key_len == key_len && memcmp(other->key, key, key_len) == 0) break;
+        slot = (slot + 1) & (set->slot_count - 1);
+    }
+    return slot;
+}
+
+const Feed *feed_set_find(const Feed_Set *set, const char *key, size_t key_len) {
+    if (set->count == 0) return NULL;
+    size_t slot = feed_set_slot(set, key, key_len, hash_bytes(key, key_len));
+    return set->slots[slot] ? &set->feeds[set->slots[slot] - 1] : NULL;
+}
+
+// Adds `feed` unless a feed with the same key is there already. Returns 0
+// then, and the caller keeps ownership of its strings.
+int feed_set_add(Feed_Set *set, const Feed *feed) {
+    // Keep the load under 70% so probe chains stay short.
+    if (10 * (set->count + 1) > 7 * set->slot_count) feed_set_grow(set);
+
+    size_t slot = feed_set_slot(set, feed->key, feed->key_len, feed->hash);
+    if (set->slots[slot]) return 0;
+
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity ? 2 * set->capacity : 256;
+        set->feeds = realloc(set->feeds, set->capacity * sizeof(Feed));
+        if (set->feeds == NULL) {
+            perror("Error: couldn't allocate feeds.");
+            exit(1);
+        }
+    }
+    set->feeds[set->count] = *feed;
+    set->slots[slot] = ++set->count;
+    return 1;
+}
+
+void feed_set_free(Feed_Set *set, int free_feeds) {
+    if (free_feeds) {
+        for (size_t i = 0; i < set->count; i++) free(set->feeds[i].url);
+    }
+    free(set->feeds);
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+// Slot of `path` in the index, or the empty slot it would go in.
+size_t category_slot(const Category_List *list, const char *path, size_t len, unsigned long long hash) {
+    size_t slot = hash & (list->slot_count - 1);
+    while (list->slots[slot]) {
+        const char *other = list->paths[list->slots[slot] - 1];
+        if (strncmp(other, path, len) == 0 && other[len] == 0) break;
+        slot = (slot + 1) & (list->slot_count - 1);
+    }
+    return slot;
+}
+
+const char *category_intern(Category_List *list, const char *path, size_t len) {
+    if (2 * (list->count + 1) > list->slot_count) {
+        size_t slot_count = list->slot_count ? 2 * list->slot_count : 64;
+        size_t *slots = calloc(slot_count, sizeof(size_t));
+        if (slots == NULL) {
+            perror("Error: couldn't allocate categories.");
+            exit(1);
+        }
+        for (size_t i = 0; i < list->count; i++) {
+            size_t slot = hash_bytes(list->paths[i], strlen(list->paths[i])) & (slot_count - 1);
+            while (slots[slot]) slot = (slot + 1) & (slot_count - 1);
+            slots[slot] = i + 1;
+        }
+        free(list->slots);
+        list->slots = slots;
+        list->slot_count = slot_count;
+    }
+
+    size_t slot = category_slot(list, path, len, hash_bytes(path, len));
+    if (list->slots[slot]) return list->paths[list->slots[slot] - 1];
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 16;
+        list->paths = realloc(list->paths, list->capacity * sizeof(char *));
+        if (list->paths == NULL) {
+            perror("Error: couldn't allocate categories.");
+            exit(1);
+        }
+    }
+    char *copy = malloc(len + 1);
+    if (copy == NULL) {
+        perror("Error: couldn't allocate categories.");
+        exit(1);
+    }
+    memcpy(copy, path, len);
+    copy[len] = 0;
+    list->paths[list->count++] = copy;
+    list->slots[slot] = list->count;
+    return copy;
+}
+
+void category_list_free(Category_List *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->paths[i]);
+    free(list->paths);
+    free(list->slots);
+    memset(list, 0, sizeof(*list));
+}
+
+// Appends the decoded name of a category to `path`, with whitespace runs
+// folded to one space. Returns 0 and leaves `path` alone when it's empty.
+int category_append(Buffer *path, const Xml_Attribute *name) {
+    buffer_reserve(path, name->value_len + 1);
+    char *start = path->data + path->len + (path->len > 0);
+    size_t len = xml_decode(name->value, name->value_len, start);
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = start[i];
+        if (is_xml_space(c) || c == CATEGORY_SEPARATOR) {
+            if (out > 0 && start[out - 1] != ' ') start[out++] = ' ';
+        } else {
+            start[out++] = c;
+        }
+    }
+    if (out > 0 && start[out - 1] == ' ') out--;
+    if (out == 0) return 0;
+
+    if (path->len) path->data[path->len] = CATEGORY_SEPARATOR;
+    path->len = start + out - path->data;
+    return 1;
+}
+
+// Collects the unique feeds of one OPML file with their categories.
+int parse_opml(const char *path, Feed_Set *feeds, Category_List *categories) {
+    Mapped_File opml_file;
+    if (!map_file(path, &opml_file)) return 0;
 
-    FILE *opml_file = fopen(argv[1], "r");
-    if (opml_file == NULL) {
+    // Path of the categories around the current outline. For every open
+    // outline, the path length before it, or -1 when it isn't a category.
+    Buffer category = {0};
+    long *open = NULL;
+    size_t open_count = 0, open_capacity = 0;
+    int depth = 0;
+    const char *current = NULL;
+
+    Opml_Tokenizer tokenizer = { opml_file.data, opml_file.data + opml_file.size };
+    Outline outline;
+    Opml_Token token;
+    while ((token = opml_next_outline(&tokenizer, &outline)) != OPML_END) {
+        if (token == OPML_OUTLINE_END) {
+            if (open_count > 0 && open[--open_count] >= 0) {
+                category.len = open[open_count];
+                depth--;
+                current = NULL;
+            }
+            continue;
+        }
+
+        const Xml_Attribute *url = outline_attribute(&outline, "xmlUrl");
+        if (!outline.self_closing) {
+            long previous = -1;
+            if (url == NULL && depth < MAX_CATEGORY_DEPTH) {
+                const Xml_Attribute *name = outline_attribute(&outline, "text");
+                if (name == NULL) name = outline_attribute(&outline, "title");
+                size_t len = category.len;
+                if (name && category_append(&category, name)) {
+                    previous = len;
+                    depth++;
+                    current = NULL;
+                }
+            }
+            if (open_count == open_capacity) {
+                open_capacity = open_capacity ? 2 * open_capacity : 16;
+                open = realloc(open, open_capacity * sizeof(long));
+                if (open == NULL) {
+                    perror("Error: couldn't allocate outlines.");
+                    exit(1);
+                }
+            }
+            open[open_count++] = previous;
+        }
+        if (url == NULL || url->value_len == 0) continue;
+
+        if (current == NULL) {
+            current = category.len ? category_intern(categories, category.data, category.len)
+                                   : category_intern(categories, DEFAULT_CATEGORY, sizeof(DEFAULT_CATEGORY) - 1);
+        }
+
+        // The decoded URL and its key share one allocation.
+        Feed feed;
+        feed.url = malloc(2 * url->value_len + 2);
+        if (feed.url == NULL) {
+            perror("Error: couldn't allocate feed.");
+            exit(1);
+        }
+        size_t url_len = xml_decode(url->value, url->value_len, feed.url);
+        feed.url[url_len] = 0;
+        feed.key = feed.url + url_len + 1;
+        feed.key_len = normalize_url(feed.url, url_len, feed.key, &feed.host_start);
+        feed.key[feed.key_len] = 0;
+        feed.hash = hash_bytes(feed.key, feed.key_len);
+        feed.category = current;
+        if (feed.key_len == 0 || !feed_set_add(feeds, &feed)) free(feed.url);
+    }
+
+    free(open);
+    free(category.data);
+    unmap_file(&opml_file);
+    return 1;
+}
+
+#ifndef _WIN32
+typedef struct {
+    Opml_Input *inputs;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} Parse_Queue;
+
+void *parse_thread(void *arg) {
+    Parse_Queue *queue = arg;
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (index >= queue->count) return NULL;
+
+        Opml_Input *input = &queue->inputs[index];
+        input->ok = parse_opml(input->path, &input->feeds, &input->categories);
+    }
+}
+#endif // _WIN32
+
+// Parses every input, a file per thread at a time.
+void parse_inputs(Opml_Input *inputs, int count) {
+#ifndef _WIN32
+    Parse_Queue queue = {0};
+    queue.inputs = inputs;
+    queue.count = count;
+    pthread_t threads[MAX_PARSE_THREADS];
+    int thread_count = count < MAX_PARSE_THREADS ? count : MAX_PARSE_THREADS;
+
+    pthread_mutex_init(&queue.lock, NULL);
+    for (int i = 1; i < thread_count; i++) pthread_create(&threads[i], NULL, parse_thread, &queue);
+    parse_thread(&queue);
+    for (int i = 1; i < thread_count; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&queue.lock);
+#else
+    for (int i = 0; i < count; i++) inputs[i].ok = parse_opml(inputs[i].path, &inputs[i].feeds, &inputs[i].categories);
+#endif // _WIN32
+}
+
+int compare_feeds(const void *a, const void *b) {
+    const Feed *x = a, *y = b;
+    int result = x->category == y->category ? 0 : strcmp(x->category, y->category);
+    if (result) return result;
+    result = strcmp(x->key + x->host_start, y->key + y->host_start);
+    return result ? result : strcmp(x->key, y->key);
+}
+
+void target_push(Section_Target **targets, size_t *count, size_t *capacity, const char *path, size_t len, size_t links_start, size_t links_end) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 16;
+        *targets = realloc(*targets, *capacity * sizeof(Section_Target));
+        if (*targets == NULL) {
+            perror("Error: couldn't allocate sections.");
+            exit(1);
+        }
+    }
+    Section_Target *target = &(*targets)[(*count)++];
+    target->path = malloc(len + 1);
+    if (target->path == NULL) {
+        perror("Error: couldn't allocate sections.");
+        exit(1);
+    }
+    memcpy(target->path, path, len);
+    target->path[len] = 0;
+    target->links_start = links_start;
+    target->links_end = links_end;
+}
+
+int compare_targets(const void *a, const void *b) {
+    return strcmp(((const Section_Target *)a)->path, ((const Section_Target *)b)->path);
+}
+
+// Lists the sorted feeds of every category into `links` and returns a
+// section for each category and its ancestors, parents first.
+Section_Target *build_targets(const Feed_Set *feeds, Buffer *links, size_t *count) {
+    Section_Target *targets = NULL;
+    size_t capacity = 0;
+    *count = 0;
+
+    for (size_t i = 0; i < feeds->count;) {
+        const char *category = feeds->feeds[i].category;
+        size_t links_start = links->len;
+        for (; i < feeds->count && feeds->feeds[i].category == category; i++) {
+            buffer_append(links, "- ", 2);
+            buffer_append(links, feeds->feeds[i].url, strlen(feeds->feeds[i].url));
+            buffer_append(links, "\n", 1);
+        }
+
+        for (const char *p = category; (p = strchr(p, CATEGORY_SEPARATOR)) != NULL; p++) {
+            target_push(&targets, count, &capacity, category, p - category, 0, 0);
+        }
+        target_push(&targets, count, &capacity, category, strlen(category), links_start, links->len);
+    }
+
+    // The separator sorts before any name, so children follow their parent.
+    // Ancestors were added once per child, keep one with the links if any.
+    qsort(targets, *count, sizeof(Section_Target), compare_targets);
+    size_t unique = 0;
+    for (size_t i = 0; i < *count; i++) {
+        if (unique > 0 && strcmp(targets[unique - 1].path, targets[i].path) == 0) {
+            if (targets[i].links_end > targets[i].links_start) {
+                targets[unique - 1].links_start = targets[i].links_start;
+                targets[unique - 1].links_end = targets[i].links_end;
+            }
+            free(targets[i].path);
+        } else {
+            targets[unique++] = targets[i];
+        }
+    }
+    *count = unique;
+    return targets;
+}
+
+// Whether the tool wrote `section`: its body starts with the marker, or
+// it's the section of feeds without a category, which older versions
+// wrote without one.
+int is_owned_section(Slice doc, const Doc_Section *section) {
+    if (strcmp(section->path, DEFAULT_CATEGORY) == 0) return 1;
+    const char *line = doc.data + section->body_start;
+    const char *body_end = doc.data + section->body_end;
+    while (line < body_end && (*line == '\n' || *line == '\r')) line++;
+    size_t len = strlen(SECTION_MARKER);
+    if ((size_t)(body_end - line) < len || memcmp(line, SECTION_MARKER, len) != 0) return 0;
+    line += len;
+    if (line < body_end && *line == '\r') line++;
+    return line == body_end || *line == '\n';
+}
+
+void push_edit(Section_Edit **edits, size_t *count, size_t *capacity, Section_Edit *edit) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 16;
+        *edits = realloc(*edits, *capacity * sizeof(Section_Edit));
+        if (*edits == NULL) {
+            perror("Error: couldn't allocate edits.");
+            exit(1);
+        }
+    }
+    edit->order = *count;
+    (*edits)[(*count)++] = *edit;
+}
+
+// Plans replacing the body of `section` with the marker and `links`,
+// unless it's that already. A blank line is left before the next heading.
+void plan_body(Slice doc, const Doc_Section *section, const char *links, size_t links_len, Buffer *text,
+               Section_Edit *edit, Section_Edit **edits, size_t *count, size_t *capacity) {
+    edit->text_start = text->len;
+    buffer_append(text, "\n" SECTION_MARKER "\n", strlen(SECTION_MARKER) + 2);
+    buffer_append(text, links, links_len);
+    // Keep a blank line between the links and the next heading.
+    if (section->body_end < doc.len) buffer_append(text, "\n", 1);
+    edit->text_len = text->len - edit->text_start;
+
+    if (section->body_end - section->body_start == edit->text_len &&
+        memcmp(doc.data + section->body_start, text->data + edit->text_start, edit->text_len) == 0) {
+        text->len = edit->text_start;
+        return;
+    }
+    edit->start = section->body_start;
+    edit->end = section->body_end;
+    edit->level = section->level;
+    push_edit(edits, count, capacity, edit);
+}
+
+// Compares every section with the file and returns the edits for the ones
+// that changed or are missing, with their new text in `text`. Sections of
+// categories that are gone are emptied when the tool wrote them.
+Section_Edit *plan_edits(Slice doc, const Section_Target *targets, size_t target_count, const Buffer *links, Buffer *text, size_t *count) {
+    size_t section_count;
+    Doc_Section *sections = scan_sections(doc, &section_count);
+    const Doc_Section **sorted = malloc(section_count * sizeof(Doc_Section *) + 1);
+    char *matched = calloc(section_count + 1, 1);
+    if (sorted == NULL || matched == NULL) {
+        perror("Error: couldn't allocate sections.");
+        exit(1);
+    }
+    for (size_t i = 0; i < section_count; i++) sorted[i] = &sections[i];
+    qsort(sorted, section_count, sizeof(Doc_Section *), compare_doc_sections);
+    Section_Edit *edits = NULL;
+    size_t capacity = 0;
+    *count = 0;
+
+    for (size_t i = 0; i < target_count; i++) {
+        const Section_Target *target = &targets[i];
+        size_t path_len = strlen(target->path);
+        const char *name = strrchr(target->path, CATEGORY_SEPARATOR);
+        name = name ? name + 1 : target->path;
+        size_t links_len = target->links_end - target->links_start;
+        Section_Edit edit = {0};
+        edit.links_start = target->links_start;
+        edit.links_end = target->links_end;
+        edit.name_start = text->len;
+        edit.name_len = strlen(name);
+        buffer_append(text, name, edit.name_len);
+
+        const Doc_Section *section = find_doc_section(sorted, section_count, target->path, path_len);
+        if (section) {
+            matched[section - sections] = 1;
+            plan_body(doc, section, links->data + target->links_start, links_len, text, &edit, &edits, count, &capacity);
+            continue;
+        }
+
+        // A new section goes at the end of its closest ancestor in the
+        // file, a level down for each category in between.
+        const Doc_Section *ancestor = NULL;
+        size_t len = path_len;
+        while (ancestor == NULL && len > 0) {
+            while (len > 0 && target->path[len - 1] != CATEGORY_SEPARATOR) len--;
+            if (len > 0) ancestor = find_doc_section(sorted, section_count, target->path, --len);
+        }
+        edit.level = ancestor ? ancestor->level : 1;
+        for (const char *p = target->path + len; p < target->path + path_len; p++) {
+            if (*p == CATEGORY_SEPARATOR || p == target->path) edit.level++;
+        }
+        if (edit.level > 6) edit.level = 6;
+        edit.start = edit.end = ancestor ? ancestor->subtree_end : doc.len;
+        edit.insert = 1;
+
+        edit.text_start = text->len;
+        for (int level = 0; level < edit.level; level++) buffer_append(text, "#", 1);
+        buffer_append(text, " ", 1);
+        buffer_append(text, name, strlen(name));
+        buffer_append(text, "\n\n" SECTION_MARKER "\n", strlen(SECTION_MARKER) + 3);
+        buffer_append(text, links->data + target->links_start, links_len);
+        edit.text_len = text->len - edit.text_start;
+        push_edit(&edits, count, &capacity, &edit);
+    }
+
+    for (size_t i = 0; i < section_count; i++) {
+        const Doc_Section *section = &sections[i];
+        if (matched[i] || !is_owned_section(doc, section)) continue;
+        const char *name = strrchr(section->path, CATEGORY_SEPARATOR);
+        name = name ? name + 1 : section->path;
+        Section_Edit edit = {0};
+        edit.name_start = text->len;
+        edit.name_len = strlen(name);
+        buffer_append(text, name, edit.name_len);
+        plan_body(doc, section, "", 0, text, &edit, &edits, count, &capacity);
+    }
+
+    for (size_t i = 0; i < section_count; i++) free(sections[i].path);
+    free(sections);
+    free(sorted);
+    free(matched);
+    return edits;
+}
+
+// Orders edits by where they start, replacements before insertions at the
+// same place, and otherwise as planned.
+int compare_edits(const void *a, const void *b) {
+    const Section_Edit *x = a, *y = b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    if (x->insert != y->insert) return x->insert - y->insert;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Number of newlines the parts end with, up to 2. The start of the file
+// counts as a blank line.
+int trailing_newlines(const Slice *parts, int count) {
+    int newlines = 0;
+    for (int i = count - 1; i >= 0; i--) {
+        for (size_t j = parts[i].len; j-- > 0;) {
+            if (parts[i].data[j] != '\n') return newlines;
+            if (++newlines == 2) return 2;
+        }
+    }
+    return 2;
+}
+
+int parse_positive(const char *option, const char *value) {
+    char *end;
+    long n = value ? strtol(value, &end, 10) : 0;
+    if (value == NULL || *value == 0 || *end != 0 || n < 1 || n > 100000) {
+        fprintf(stderr, "Error: `%s` needs a positive number.\n", option);
+        exit(1);
+    }
+    return n;
+}
+
+#ifdef OPML_CHECK
+#define CHECK_RESPONSE_SIZE 4096
+#define CHECK_RESOLVER_THREADS 16
+
+typedef enum {
+    CHECK_WAITING,
+    CHECK_CONNECTING,
+    CHECK_HANDSHAKE,
+    CHECK_SENDING,
+    CHECK_RECEIVING,
+    CHECK_DONE
+} Check_State;
+
+typedef struct {
+    char *name;
+    char port[8];
+    struct addrinfo *addresses;
+    int resolve_error;
+    int active;
+    // Its checks that haven't started, linked by `next_waiting`.
+    int first_waiting;
+    int last_waiting;
+    int ready;
+} Check_Host;
+
+typedef struct {
+    char *url;
+    char *path;
+    int tls;
+    int host;
+    int next_waiting;
+
+    Check_State state;
+    int fd;
+    // The address being tried, the next ones are tried when it fails.
+    const struct addrinfo *address;
+    int use_get;
+    char request[1024];
+    size_t request_len;
+    size_t sent;
+    char response[CHECK_RESPONSE_SIZE];
+    size_t received;
+    unsigned long long started_ms;
+    unsigned long long deadline_ms;
+#ifdef OPML_TLS
+    SSL *ssl;
+#endif // OPML_TLS
+
+    int status;
+    unsigned long long latency_ms;
+    char *location;
+    const char *error;
+} Check;
+
+typedef struct {
+    Check *checks;
+    int check_count;
+    Check_Host *hosts;
+    int host_count;
+    int next_host;
+    pthread_mutex_t lock;
+
+    int jobs;
+    int per_host;
+    unsigned long long timeout_ms;
+    int epoll_fd;
+    int active;
+    int done;
+    // Hosts with a check waiting and room for it, taken in turn.
+    int *ready;
+    int ready_head;
+    int ready_count;
+    // Checks in the order they started, which is the order of their
+    // deadlines, from the first one that may still run.
+    int *started;
+    int started_head;
+    int started_count;
+#ifdef OPML_TLS
+    SSL_CTX *tls;
+#endif // OPML_TLS
+} Checker;
+
+unsigned long long check_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Splits an http or https `url` into the check, adding its host to the
+// table. Returns 0 for anything else.
+int check_parse_url(Checker *checker, Check *check) {
+    const char *p = check->url;
+    if (strncmp(p, "http://", 7) == 0) {
+        p += 7;
+    } else if (strncmp(p, "https://", 8) == 0) {
+        p += 8;
+        check->tls = 1;
+    } else {
+        return 0;
+    }
+
+    size_t authority_len = strcspn(p, "/?#");
+    const char *path = p + authority_len;
+    const char *at = memchr(p, '@', authority_len);
+    if (at) {
+        authority_len -= at + 1 - p;
+        p = at + 1;
+    }
+
+    // The host is a name, an address or an [IPv6] address, maybe followed
+    // by a port.
+    size_t host_len = authority_len;
+    if (*p == '[') {
+        const char *close = memchr(p, ']', authority_len);
+        if (close == NULL) return 0;
+        host_len = close + 1 - p;
+    } else {
+        const char *colon = memchr(p, ':', authority_len);
+        if (colon) host_len = colon - p;
+    }
+    if (host_len == 0) return 0;
+
+    const char *port = check->tls ? "443" : "80";
+    char port_buffer[8];
+    if (host_len < authority_len) {
+        size_t port_len = authority_len - host_len - 1;
+        if (p[host_len] != ':' || port_len == 0 || port_len >= sizeof(port_buffer)) return 0;
+        memcpy(port_buffer, p + host_len + 1, port_len);
+        port_buffer[port_len] = 0;
+        port = port_buffer;
+    }
+
+    char *host = malloc(host_len + 1);
+    if (host == NULL) return 0;
+    memcpy(host, p, host_len);
+    host[host_len] = 0;
+    for (char *c = host; *c; c++) if (*c >= 'A' && *c <= 'Z') *c += 'a' - 'A';
+
+    size_t path_len = strcspn(path, "#");
+    check->path = malloc(path_len + 2);
+    if (check->path == NULL) return 0;
+    if (*path == '/') {
+        memcpy(check->path, path, path_len);
+        check->path[path_len] = 0;
+    } else {
+        check->path[0] = '/';
+        memcpy(check->path + 1, path, path_len);
+        check->path[path_len + 1] = 0;
+    }
+
+    for (int i = 0; i < checker->host_count; i++) {
+        if (strcmp(checker->hosts[i].name, host) == 0 && strcmp(checker->hosts[i].port, port) == 0) {
+            check->host = i;
+            free(host);
+            return 1;
+        }
+    }
+
+    checker->hosts = realloc(checker->hosts, (checker->host_count + 1) * sizeof(Check_Host));
+    if (checker->hosts == NULL) return 0;
+    Check_Host *entry = &checker->hosts[checker->host_count];
+    memset(entry, 0, sizeof(*entry));
+    entry->name = host;
+    snprintf(entry->port, sizeof(entry->port), "%s", port);
+    check->host = checker->host_count++;
+    return 1;
+}
+
+// Resolves hosts off the shared table until none are left, getaddrinfo
+// blocks so a few threads do it at once before the event loop starts.
+void *check_resolve_thread(void *arg) {
+    Checker *checker = arg;
+    while (1) {
+        pthread_mutex_lock(&checker->lock);
+        int index = checker->next_host++;
+        pthread_mutex_unlock(&checker->lock);
+        if (index >= checker->host_count) return NULL;
+
+        Check_Host *host = &checker->hosts[index];
+        struct addrinfo hints = {0};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        const char *name = host->name;
+        char literal[64];
+        if (name[0] == '[') {
+            snprintf(literal, sizeof(literal), "%.*s", (int)strlen(name) - 2, name + 1);
+            name = literal;
+        }
+        host->resolve_error = getaddrinfo(name, host->port, &hints, &host->addresses);
+    }
+}
+
+void check_close(Checker *checker, Check *check) {
+    if (check->fd >= 0) {
+        epoll_ctl(checker->epoll_fd, EPOLL_CTL_DEL, check->fd, NULL);
+        close(check->fd);
+        check->fd = -1;
+    }
+#ifdef OPML_TLS
+    if (check->ssl) {
+        SSL_free(check->ssl);
+        check->ssl = NULL;
+    }
+#endif // OPML_TLS
+}
+
+// Queues host `index` to start its next check when it has one and room.
+void check_ready(Checker *checker, int index) {
+    Check_Host *host = &checker->hosts[index];
+    if (host->ready || host->first_waiting < 0 || host->active >= checker->per_host) return;
+    host->ready = 1;
+    checker->ready[(checker->ready_head + checker->ready_count++) % checker->host_count] = index;
+}
+
+void check_finish(Checker *checker, Check *check, const char *error) {
+    check_close(checker, check);
+    if (check->state != CHECK_WAITING) {
+        checker->hosts[check->host].active--;
+        checker->active--;
+    }
+    check->error = error;
+    check->latency_ms = check_now_ms() - check->started_ms;
+    check->state = CHECK_DONE;
+    checker->done++;
+    check_ready(checker, check->host);
+}
+
+void check_watch(Checker *checker, Check *check, unsigned int events, int op) {
+    struct epoll_event event = {0};
+    event.events = events;
+    event.data.ptr = check;
+    epoll_ctl(checker->epoll_fd, op, check->fd, &event);
+}
+
+// Connects to `address`, or the first of the ones after it that takes it.
+void check_connect(Checker *checker, Check *check, const struct addrinfo *address) {
+    Check_Host *host = &checker->hosts[check->host];
+    // The name keeps the brackets of an IPv6 address, the port is left out
+    // when it's the scheme's.
+    int default_port = strcmp(host->port, check->tls ? "443" : "80") == 0;
+    check->request_len = snprintf(check->request, sizeof(check->request),
+        "%s %s HTTP/1.1\r\n"
+        "Host: %s%s%s\r\n"
+        "User-Agent: opml_feed_link\r\n"
+        "Accept: */*\r\n"
+        "Connection: close\r\n"
+        "\r\n", check->use_get ? "GET" : "HEAD", check->path, host->name,
+        default_port ? "" : ":", default_port ? "" : host->port);
+    if (check->request_len >= sizeof(check->request)) {
+        check_finish(checker, check, "url too long");
+        return;
+    }
+    check->sent = 0;
+    check->received = 0;
+
+    int error = EHOSTUNREACH;
+    for (; address; address = address->ai_next) {
+        check->address = address;
+        check->fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+        if (check->fd < 0) {
+            error = errno;
+            continue;
+        }
+        if (connect(check->fd, address->ai_addr, address->ai_addrlen) == 0 || errno == EINPROGRESS) {
+            check_watch(checker, check, EPOLLOUT, EPOLL_CTL_ADD);
+            return;
+        }
+        error = errno;
+        close(check->fd);
+        check->fd = -1;
+    }
+    check_finish(checker, check, strerror(error));
+}
+
+void check_start(Checker *checker, Check *check) {
+    Check_Host *host = &checker->hosts[check->host];
+    check->started_ms = check_now_ms();
+    check->deadline_ms = check->started_ms + checker->timeout_ms;
+    check->state = CHECK_CONNECTING;
+    host->active++;
+    checker->active++;
+
+    if (host->resolve_error) {
+        check_finish(checker, check, gai_strerror(host->resolve_error));
+        return;
+    }
+#ifndef OPML_TLS
+    if (check->tls) {
+        check_finish(checker, check, "https needs a build with OPML_TLS");
+        return;
+    }
+#endif // OPML_TLS
+    check_connect(checker, check, host->addresses);
+}
+
+// Reads the status and Location out of the headers received so far.
+void check_parse_response(Check *check) {
+    char *end = check->response + check->received;
+    *end = 0;
+    if (sscanf(check->response, "HTTP/%*d.%*d %d", &check->status) != 1) {
+        check->status = 0;
+        return;
+    }
+
+    char *line = strstr(check->response, "\r\n");
+    while (line && line + 2 < end) {
+        line += 2;
+        if (strncasecmp(line, "Location:", 9) == 0) {
+            char *value = line + 9;
+            while (*value == ' ' || *value == '\t') value++;
+            size_t len = strcspn(value, "\r\n");
+            check->location = malloc(len + 1);
+            if (check->location) {
+                memcpy(check->location, value, len);
+                check->location[len] = 0;
+            }
+            return;
+        }
+        line = strstr(line, "\r\n");
+    }
+}
+
+// Runs a step of the check on readiness. Each step either finishes the
+// check or waits for the events it needs next.
+void check_step(Checker *checker, Check *check) {
+    if (check->state == CHECK_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(check->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error) {
+            // A dual stack host may not be reachable over the first family.
+            if (check->address->ai_next) {
+                check_close(checker, check);
+                check_connect(checker, check, check->address->ai_next);
+            } else {
+                check_finish(checker, check, strerror(error));
+            }
+            return;
+        }
+#ifdef OPML_TLS
+        if (check->tls) {
+            const char *name = checker->hosts[check->host].name;
+            check->ssl = SSL_new(checker->tls);
+            SSL_set_fd(check->ssl, check->fd);
+            // The certificate has to be for this host, not just any valid one.
+            unsigned char ip[16];
+            if (inet_pton(AF_INET, name, ip) == 1 || inet_pton(AF_INET6, name, ip) == 1) {
+                X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(check->ssl), name);
+            } else {
+                SSL_set_tlsext_host_name(check->ssl, name);
+                SSL_set1_host(check->ssl, name);
+            }
+            check->state = CHECK_HANDSHAKE;
+        } else
+#endif // OPML_TLS
+        check->state = CHECK_SENDING;
+    }
+
+    unsigned int want = 0;
+    while (check->state != CHECK_DONE && want == 0) {
+        ssize_t n = 0;
+        int would_block_events = 0;
+
+#ifdef OPML_TLS
+        if (check->ssl) {
+            int result;
+            if (check->state == CHECK_HANDSHAKE) {
+                result = SSL_connect(check->ssl);
+                if (result == 1) {
+                    check->state = CHECK_SENDING;
+                    continue;
+                }
+            } else if (check->state == CHECK_SENDING) {
+                result = SSL_write(check->ssl, check->request + check->sent, check->request_len - check->sent);
+            } else {
+                result = SSL_read(check->ssl, check->response + check->received,
+                                  CHECK_RESPONSE_SIZE - 1 - check->received);
+            }
+            if (result > 0) {
+                n = result;
+            } else {
+                int error = SSL_get_error(check->ssl, result);
+                if (error == SSL_ERROR_WANT_READ) would_block_events = EPOLLIN;
+                else if (error == SSL_ERROR_WANT_WRITE) would_block_events = EPOLLOUT;
+                else if (error == SSL_ERROR_ZERO_RETURN) n = 0;
+                else {
+                    check_finish(checker, check, check->state == CHECK_HANDSHAKE ? "tls handshake failed" : "tls error");
+                    return;
+                }
+            }
+        } else
+#endif // OPML_TLS
+        if (check->state == CHECK_SENDING) {
+            n = send(check->fd, check->request + check->sent, check->request_len - check->sent, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) would_block_events = EPOLLOUT;
+        } else {
+            n = recv(check->fd, check->response + check->received, CHECK_RESPONSE_SIZE - 1 - check->received, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) would_block_events = EPOLLIN;
+        }
+
+        if (would_block_events) {
+            want = would_block_events;
+        } else if (n < 0) {
+            check_finish(checker, check, strerror(errno));
+            return;
+        } else if (check->state == CHECK_SENDING) {
+            check->sent += n;
+            if (check->sent == check->request_len) check->state = CHECK_RECEIVING;
+        } else {
+            check->received += n;
+            check->response[check->received] = 0;
+            int complete = n == 0 || check->received == CHECK_RESPONSE_SIZE - 1 ||
+                           strstr(check->response, "\r\n\r\n") != NULL;
+            if (!complete) continue;
+
+            check_parse_response(check);
+            if (!check->use_get && (check->status == 405 || check->status == 501)) {
+                // HEAD isn't allowed, ask again with GET and stop after the headers.
+                check->use_get = 1;
+                check->status = 0;
+                free(check->location);
+                check->location = NULL;
+                check_close(checker, check);
+                check->state = CHECK_CONNECTING;
+                check_connect(checker, check, checker->hosts[check->host].addresses);
+                return;
+            }
+            check_finish(checker, check, check->status ? NULL : "bad response");
+            return;
+        }
+    }
+
+    if (check->state != CHECK_DONE) check_watch(checker, check, want, EPOLL_CTL_MOD);
+}
+
+int check_feeds(Checker *checker) {
+    checker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (checker->epoll_fd < 0) {
+        perror("Error: couldn't create epoll.");
+        return 0;
+    }
+
+    checker->ready = malloc(checker->host_count * sizeof(int) + 1);
+    checker->started = malloc(checker->check_count * sizeof(int) + 1);
+    if (checker->ready == NULL || checker->started == NULL) {
+        perror("Error: couldn't allocate checks.");
+        return 0;
+    }
+    for (int i = 0; i < checker->host_count; i++) {
+        checker->hosts[i].first_waiting = checker->hosts[i].last_waiting = -1;
+    }
+    for (int i = 0; i < checker->check_count; i++) {
+        Check *check = &checker->checks[i];
+        if (check->state != CHECK_WAITING) {
+            checker->done++;
+            continue;
+        }
+        Check_Host *host = &checker->hosts[check->host];
+        check->next_waiting = -1;
+        if (host->last_waiting < 0) host->first_waiting = i;
+        else checker->checks[host->last_waiting].next_waiting = i;
+        host->last_waiting = i;
+    }
+    for (int i = 0; i < checker->host_count; i++) check_ready(checker, i);
+
+    struct epoll_event events[64];
+    while (checker->done < checker->check_count) {
+        unsigned long long now = check_now_ms();
+        unsigned long long deadline = now + 1000;
+        while (checker->started_head < checker->started_count) {
+            Check *check = &checker->checks[checker->started[checker->started_head]];
+            if (check->state != CHECK_DONE && check->deadline_ms > now) {
+                if (check->deadline_ms < deadline) deadline = check->deadline_ms;
+                break;
+            }
+            if (check->state != CHECK_DONE) check_finish(checker, check, "timeout");
+            checker->started_head++;
+        }
+
+        while (checker->active < checker->jobs && checker->ready_count > 0) {
+            int index = checker->ready[checker->ready_head];
+            checker->ready_head = (checker->ready_head + 1) % checker->host_count;
+            checker->ready_count--;
+            Check_Host *host = &checker->hosts[index];
+            host->ready = 0;
+            int next = host->first_waiting;
+            host->first_waiting = checker->checks[next].next_waiting;
+            if (host->first_waiting < 0) host->last_waiting = -1;
+            checker->started[checker->started_count++] = next;
+            check_start(checker, &checker->checks[next]);
+            check_ready(checker, index);
+        }
+
+        int count = 0;
+        if (checker->active > 0) {
+            count = epoll_wait(checker->epoll_fd, events, 64, deadline - now);
+            if (count < 0 && errno != EINTR) {
+                perror("Error: epoll_wait failed.");
+                return 0;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            Check *check = events[i].data.ptr;
+            if (check->state != CHECK_DONE) check_step(checker, check);
+        }
+    }
+
+    free(checker->ready);
+    free(checker->started);
+    close(checker->epoll_fd);
+    return 1;
+}
+
+int check_main(int argc, char *argv[]) {
+    Checker checker = {0};
+    const char *opml_path = NULL;
+    checker.jobs = 64;
+    checker.per_host = 4;
+    checker.timeout_ms = 10000;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--jobs") == 0) {
+            checker.jobs = parse_positive(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--per-host") == 0) {
+            checker.per_host = parse_positive(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--timeout") == 0) {
+            checker.timeout_ms = parse_positive(argv[i], argv[i + 1]) * 1000ULL;
+            i++;
+        } else {
+            opml_path = argv[i];
+        }
+    }
+    if (opml_path == NULL) {
+        fprintf(stderr, "Usage: %s --check [--jobs N] [--per-host N] [--timeout SECONDS] <opml_file>\n", argv[0]);
+        return 1;
+    }
+
+    Mapped_File opml_file;
+    if (!map_file(opml_path, &opml_file)) {
         perror("Error: couldn't opening opml file.");
         return 1;
     }
 
-    printf("Written following line in %s:\n", argv[2]);
-    while (fgets(line, MAX_LINE_LENGTH, opml_file) != NULL) {
-        for (size_t i = 0; i < strlen(line); i++) {
-            if (line[i] == 'x' && line[i+7] == '"' && line[i+8] == 'h') {
-                putc('-', temp_file); putc(' ', temp_file);
-                printf("- ");
+    Opml_Tokenizer tokenizer = { opml_file.data, opml_file.data + opml_file.size };
+    Outline outline;
+    int capacity = 0;
+    Opml_Token token;
+    while ((token = opml_next_outline(&tokenizer, &outline)) != OPML_END) {
+        if (token != OPML_OUTLINE) continue;
+        const Xml_Attribute *url = outline_attribute(&outline, "xmlUrl");
+        if (url == NULL || url->value_len == 0) continue;
 
-                for (size_t j = i+8; line[j] != '"'; j++) {
-                    putc(line[j], temp_file);
-                    printf("%c", line[j]);
-                }
+        if (checker.check_count == capacity) {
+            capacity = capacity ? 2 * capacity : 256;
+            checker.checks = realloc(checker.checks, capacity * sizeof(Check));
+            if (checker.checks == NULL) {
+                perror("Error: couldn't allocate checks.");
+                return 1;
+            }
+        }
+        Check *check = &checker.checks[checker.check_count];
+        memset(check, 0, sizeof(*check));
+        check->fd = -1;
+        check->url = malloc(url->value_len + 1);
+        if (check->url == NULL) {
+            perror("Error: couldn't allocate url.");
+            return 1;
+        }
+        check->url[xml_decode(url->value, url->value_len, check->url)] = 0;
+        checker.check_count++;
+
+        if (!check_parse_url(&checker, check)) {
+            check->state = CHECK_DONE;
+            check->error = "unsupported url";
+        }
+    }
+    unmap_file(&opml_file);
+
+#ifdef OPML_TLS
+    checker.tls = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_default_verify_paths(checker.tls);
+    SSL_CTX_set_verify(checker.tls, SSL_VERIFY_PEER, NULL);
+#endif // OPML_TLS
+
+    pthread_t resolvers[CHECK_RESOLVER_THREADS];
+    int resolver_count = checker.host_count < CHECK_RESOLVER_THREADS ? checker.host_count : CHECK_RESOLVER_THREADS;
+    pthread_mutex_init(&checker.lock, NULL);
+    for (int i = 0; i < resolver_count; i++) {
+        pthread_create(&resolvers[i], NULL, check_resolve_thread, &checker);
+    }
+    for (int i = 0; i < resolver_count; i++) pthread_join(resolvers[i], NULL);
+    pthread_mutex_destroy(&checker.lock);
+
+    if (!check_feeds(&checker)) return 1;
+
+    int failed = 0;
+    for (int i = 0; i < checker.check_count; i++) {
+        Check *check = &checker.checks[i];
+        if (check->error) {
+            failed++;
+            printf("ERR %6llums %s (%s)\n", check->latency_ms, check->url, check->error);
+        } else if (check->location) {
+            printf("%d %6llums %s -> %s\n", check->status, check->latency_ms, check->url, check->location);
+        } else {
+            printf("%d %6llums %s\n", check->status, check->latency_ms, check->url);
+        }
+        if (!check->error && check->status >= 400) failed++;
+
+        free(check->url);
+        free(check->path);
+        free(check->location);
+    }
+    fprintf(stderr, "Checked %d feeds, %d failed.\n", checker.check_count, failed);
+
+    for (int i = 0; i < checker.host_count; i++) {
+        if (checker.hosts[i].addresses) freeaddrinfo(checker.hosts[i].addresses);
+        free(checker.hosts[i].name);
+    }
+    free(checker.hosts);
+    free(checker.checks);
+#ifdef OPML_TLS
+    SSL_CTX_free(checker.tls);
+#endif // OPML_TLS
+    return failed ? 2 : 0;
+}
+#endif // OPML_CHECK
+
+// Updates the sections of the feeds' categories in `doc`, the mapped output
+// file. Returns 1 when it was written, 0 when it was up to date and -1 when
+// writing failed.
+int write_sections(const char *output_path, Slice doc, const Feed_Set *feeds, int quiet) {
+    Buffer links = {0};
+    size_t target_count;
+    Section_Target *targets = build_targets(feeds, &links, &target_count);
+
+    Buffer text = {0};
+    size_t edit_count;
+    Section_Edit *edits = plan_edits(doc, targets, target_count, &links, &text, &edit_count);
+    int written = 0;
+    if (edit_count > 0) {
+        qsort(edits, edit_count, sizeof(Section_Edit), compare_edits);
+
+        // Everything between the edits is passed through from the mapping.
+        Slice *parts = malloc((4 * edit_count + 1) * sizeof(Slice));
+        if (parts == NULL) {
+            perror("Error: couldn't allocate parts.");
+            exit(1);
+        }
+        int count = 0;
+        size_t cursor = 0;
+        for (size_t i = 0; i < edit_count; i++) {
+            const Section_Edit *edit = &edits[i];
+            if (edit->start > cursor) parts[count++] = (Slice){ doc.data + cursor, edit->start - cursor };
+            if (edit->insert) {
+                // New sections get a blank line around them.
+                int newlines = trailing_newlines(parts, count);
+                if (newlines < 2) parts[count++] = (Slice){ "\n\n", 2 - newlines };
+            }
+            parts[count++] = (Slice){ text.data + edit->text_start, edit->text_len };
+            if (edit->insert && edit->start < doc.len &&
+                (i + 1 == edit_count || edits[i + 1].start != edit->start)) {
+                parts[count++] = (Slice){ "\n", 1 };
+            }
+            if (edit->end > cursor) cursor = edit->end;
+        }
+        if (cursor < doc.len) parts[count++] = (Slice){ doc.data + cursor, doc.len - cursor };
+        written = splice_file(output_path, parts, count) ? 1 : -1;
+        free(parts);
+    }
+
+    if (written > 0 && !quiet) {
+        printf("Written following line in %s:\n", output_path);
+        for (size_t i = 0; i < edit_count; i++) {
+            const Section_Edit *edit = &edits[i];
+            printf("%.*s %.*s\n", edit->level, "######", (int)edit->name_len, text.data + edit->name_start);
+            fwrite(links.data + edit->links_start, 1, edit->links_end - edit->links_start, stdout);
+        }
+    }
+
+    for (size_t i = 0; i < target_count; i++) free(targets[i].path);
+    free(targets);
+    free(edits);
+    free(text.data);
+    free(links.data);
+    return written;
+}
+
+#ifndef _WIN32
+#define BENCH_SIZES "1000,10000,100000,1000000"
+// Categories nest deeper than MAX_CATEGORY_DEPTH to check the folding.
+#define BENCH_MAX_DEPTH 8
+// fgets buffer of the matcher opml_feed_link started with.
+#define BENCH_LEGACY_LINE 450
+// Hand-written links in the output, the rewrite must leave them alone.
+#define BENCH_FOREIGN_SECTION "## Bookmarks\n\n- https://example.com/bookmark\n"
 
-                putc('\n', temp_file);
-                printf("\n");
+typedef struct {
+    // The feeds as they should come out of the parser, keyed by their
+    // decoded URL.
+    Feed_Set expected;
+    Category_List categories;
+    size_t outlines;
+    size_t bytes;
+} Bench_Corpus;
+
+typedef struct {
+    const char *stage;
+    double seconds;
+    size_t bytes;
+    size_t found;
+    size_t wrong;
+    int failed;
+} Bench_Result;
+
+unsigned bench_random(unsigned long long *state) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 33;
+}
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void buffer_printf(Buffer *buffer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    buffer_reserve(buffer, len + 1);
+    va_start(args, format);
+    vsnprintf(buffer->data + buffer->len, len + 1, format, args);
+    va_end(args);
+    buffer->len += len;
+}
+
+void bench_expect(Bench_Corpus *corpus, const char *url, const char *category) {
+    Feed feed = {0};
+    feed.key_len = strlen(url);
+    feed.url = feed.key = malloc(feed.key_len + 1);
+    if (feed.url == NULL) {
+        perror("Error: couldn't allocate feed.");
+        exit(1);
+    }
+    memcpy(feed.url, url, feed.key_len + 1);
+    feed.hash = hash_bytes(feed.key, feed.key_len);
+    feed.category = category;
+    if (!feed_set_add(&corpus->expected, &feed)) free(feed.url);
+}
+
+// Writes an OPML file of `feed_count` feeds the way exporters in the wild
+// do: attributes in any order with either quote, spread over lines or
+// packed into lines far longer than a line buffer, nested categories with
+// entities in their names and outlines inside comments that aren't feeds.
+int bench_generate(Bench_Corpus *corpus, size_t feed_count, int fd) {
+    unsigned long long seed = 0x9e3779b97f4a7c15ULL ^ feed_count;
+    Buffer out = {0};
+    Buffer path = {0};
+    size_t path_len[BENCH_MAX_DEPTH + 1];
+    int depth = 0;
+    size_t category_id = 0;
+    const char *category = category_intern(&corpus->categories, DEFAULT_CATEGORY, sizeof(DEFAULT_CATEGORY) - 1);
+    char url[128], decoded[128];
+
+    buffer_printf(&out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                        "<!-- synthetic corpus, %zu feeds -->\n"
+                        "<opml version=\"2.0\">\n<head><title>bench</title></head>\n<body>\n", feed_count);
+
+    for (size_t i = 0; i < feed_count; i++) {
+        unsigned r = bench_random(&seed);
+        if (r % 16 == 0 && depth < BENCH_MAX_DEPTH) {
+            size_t id = category_id++;
+            int ampersand = id % 5 == 0;
+            buffer_printf(&out, "<outline text=\"%s %zu\" title=\"group\">\n", ampersand ? "R&amp;D" : "Group", id);
+            path_len[depth++] = path.len;
+            if (depth <= MAX_CATEGORY_DEPTH) {
+                char separator = CATEGORY_SEPARATOR;
+                if (path.len) buffer_append(&path, &separator, 1);
+                buffer_printf(&path, "%s %zu", ampersand ? "R&D" : "Group", id);
+                category = category_intern(&corpus->categories, path.data, path.len);
+            }
+            corpus->outlines++;
+        } else if (r % 16 == 1 && depth > 0) {
+            buffer_append(&out, "</outline>\n", 11);
+            path.len = path_len[--depth];
+            category = path.len ? category_intern(&corpus->categories, path.data, path.len)
+                                : category_intern(&corpus->categories, DEFAULT_CATEGORY, sizeof(DEFAULT_CATEGORY) - 1);
+        } else if (r % 64 == 2) {
+            buffer_printf(&out, "<outline text=\"Note %zu\"/>\n", i);
+            corpus->outlines++;
+        } else if (r % 64 == 3) {
+            buffer_printf(&out, "<!-- <outline xmlUrl=\"https://decoy.example/%zu\"/> -->\n", i);
+        }
+
+        // Some URLs have a query with an escaped ampersand.
+        const char *scheme = r & 0x100 ? "http" : "https";
+        int query = (r & 0x600) == 0;
+        snprintf(url, sizeof(url), "%s://feed%zu.example.com/podcast/%zu.xml%s", scheme, i % 997, i, query ? "?format=rss&amp;v=2" : "");
+        snprintf(decoded, sizeof(decoded), "%s://feed%zu.example.com/podcast/%zu.xml%s", scheme, i % 997, i, query ? "?format=rss&v=2" : "");
+        bench_expect(corpus, decoded, category);
+
+        unsigned order = bench_random(&seed);
+        char quote = order % 4 == 0 ? '\'' : '"';
+        const char *separator = order & 0x10 ? "\n        " : order & 0x20 ? "\t" : " ";
+        const char *equals = order % 16 == 5 ? " = " : "=";
+        // One in eight carries a long description.
+        int attribute_count = (order >> 12) % 8 == 0 ? 6 : 5;
+        int start = (order >> 16) % attribute_count;
+
+        buffer_append(&out, "<outline", 8);
+        for (int k = 0; k < attribute_count; k++) {
+            buffer_append(&out, separator, strlen(separator));
+            switch ((start + k) % attribute_count) {
+            case 0: buffer_printf(&out, "type%s%crss%c", equals, quote, quote); break;
+            case 1: buffer_printf(&out, "text%s%cFeed %zu%c", equals, quote, i, quote); break;
+            case 2: buffer_printf(&out, "title%s%cFeed &quot;%zu&quot;%c", equals, quote, i, quote); break;
+            case 3: buffer_printf(&out, "xmlUrl%s%c%s%c", equals, quote, url, quote); break;
+            case 4: buffer_printf(&out, "htmlUrl%s%chttps://feed%zu.example.com/%c", equals, quote, i % 997, quote); break;
+            case 5:
+                buffer_printf(&out, "description%s%c", equals, quote);
+                for (int words = 0; words < 60; words++) buffer_append(&out, "lorem ipsum ", 12);
+                buffer_append(&out, &quote, 1);
+                break;
             }
         }
+        if (order & 0x80) buffer_append(&out, "></outline>", 11);
+        else buffer_append(&out, "/>", 2);
+        // A quarter of the feeds share their line with the next one.
+        if (order & 0x300) buffer_append(&out, "\n", 1);
+        corpus->outlines++;
+    }
+    while (depth-- > 0) buffer_append(&out, "</outline>\n", 11);
+    buffer_append(&out, "</body>\n</opml>\n", 16);
+
+    corpus->bytes = out.len;
+    for (size_t written = 0; written < out.len;) {
+        ssize_t n = write(fd, out.data + written, out.len - written);
+        if (n < 0) {
+            free(out.data);
+            free(path.data);
+            return 0;
+        }
+        written += n;
     }
+    free(out.data);
+    free(path.data);
+    return 1;
+}
+
+// The matcher opml_feed_link started with: `xmlUrl="h` at fixed offsets of
+// each fgets line, the URL copied up to the next quote on that line.
+// Counts the expected feeds it finds and what else it takes for a URL.
+void bench_legacy(const char *path, const Bench_Corpus *corpus, Bench_Result *result) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        result->failed = 1;
+        return;
+    }
+    char *seen = calloc(corpus->expected.count, 1);
+    char line[BENCH_LEGACY_LINE];
+    result->found = result->wrong = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strlen(line);
+        for (size_t i = 0; i + 8 < len; i++) {
+            if (line[i] != 'x' || line[i + 7] != '"' || line[i + 8] != 'h') continue;
+            const char *url = line + i + 8;
+            const char *quote = memchr(url, '"', line + len - url);
+            size_t url_len = (quote ? quote : line + len) - url;
+            if (url_len && url[url_len - 1] == '\n') url_len--;
+
+            const Feed *feed = feed_set_find(&corpus->expected, url, url_len);
+            if (feed && !seen[feed - corpus->expected.feeds]) {
+                seen[feed - corpus->expected.feeds] = 1;
+                result->found++;
+            } else {
+                result->wrong++;
+            }
+        }
+    }
+    fclose(fp);
+    free(seen);
+    result->failed = result->found != corpus->expected.count || result->wrong;
+}
 
-    rewind(temp_file);
-    rewind(output_file);
-    while (fgets(line, MAX_LINE_LENGTH, temp_file)) {
-        fprintf(output_file, line);
+// Checks every parsed feed is expected, in its category.
+void bench_verify(const Feed_Set *feeds, const Bench_Corpus *corpus, Bench_Result *result) {
+    result->found = result->wrong = 0;
+    for (size_t i = 0; i < feeds->count; i++) {
+        const Feed *feed = &feeds->feeds[i];
+        const Feed *expected = feed_set_find(&corpus->expected, feed->url, strlen(feed->url));
+        if (expected && strcmp(expected->category, feed->category) == 0) result->found++;
+        else result->wrong++;
+    }
+    result->failed = result->found != corpus->expected.count || result->wrong;
+}
+
+int bench_reset_file(const char *path, const char *data) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return 0;
+    fputs(data, fp);
+    return fclose(fp) == 0;
+}
+
+void bench_print(const Bench_Corpus *corpus, const Bench_Result *result, int csv) {
+    double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+    size_t missed = corpus->expected.count > result->found ? corpus->expected.count - result->found : 0;
+    const char *status = result->failed ? "FAIL" : "ok";
+    if (csv) {
+        printf("%zu,%s,%zu,%.6f,%.1f,%.0f,%zu,%zu,%zu,%s\n", corpus->outlines, result->stage, result->bytes,
+               result->seconds, result->bytes / seconds / 1e6, corpus->outlines / seconds,
+               result->found, missed, result->wrong, status);
+    } else {
+        printf("%10zu  %-9s %9.2f MB %9.4f s %9.1f MB/s %12.0f outlines/s  %9zu missed %7zu wrong  %s\n",
+               corpus->outlines, result->stage, result->bytes / 1e6, result->seconds,
+               result->bytes / seconds / 1e6, corpus->outlines / seconds, missed, result->wrong, status);
+    }
+}
+
+// Runs every stage on a corpus of `feed_count` feeds, best of `runs`.
+// Returns 0 when the parser or the rewrite got something wrong.
+int bench_size(size_t feed_count, int runs, int csv) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == 0) dir = "/tmp";
+    char opml_path[4096], output_path[4096];
+    snprintf(opml_path, sizeof(opml_path), "%s/opml_bench.XXXXXX", dir);
+    snprintf(output_path, sizeof(output_path), "%s/opml_bench_md.XXXXXX", dir);
+    int opml_fd = mkstemp(opml_path);
+    int output_fd = mkstemp(output_path);
+    if (opml_fd < 0 || output_fd < 0) {
+        perror("Error: couldn't create benchmark files.");
+        exit(1);
+    }
+    close(output_fd);
+
+    Bench_Corpus corpus = {0};
+    if (!bench_generate(&corpus, feed_count, opml_fd)) {
+        perror("Error: couldn't write benchmark corpus.");
+        exit(1);
+    }
+    close(opml_fd);
+
+    Bench_Result extract = { "extract", 0, corpus.bytes, 0, 0, 0 };
+    Bench_Result legacy = { "legacy", 0, corpus.bytes, 0, 0, 0 };
+    Bench_Result rewrite = { "rewrite", 0, 0, 0, 0, 0 };
+    Bench_Result unchanged = { "unchanged", 0, 0, 0, 0, 0 };
+    Feed_Set feeds = {0};
+    Category_List categories = {0};
+
+    for (int run = 0; run < runs; run++) {
+        feed_set_free(&feeds, 1);
+        category_list_free(&categories);
+        double start = bench_now();
+        if (!parse_opml(opml_path, &feeds, &categories)) extract.failed = 1;
+        double seconds = bench_now() - start;
+        if (run == 0 || seconds < extract.seconds) extract.seconds = seconds;
+    }
+    if (!extract.failed) bench_verify(&feeds, &corpus, &extract);
+
+    for (int run = 0; run < runs; run++) {
+        double start = bench_now();
+        bench_legacy(opml_path, &corpus, &legacy);
+        double seconds = bench_now() - start;
+        if (run == 0 || seconds < legacy.seconds) legacy.seconds = seconds;
+    }
+
+    // Sorting is part of the rewrite, on a copy so each run starts over.
+    Feed_Set sorted = feeds;
+    sorted.feeds = malloc(feeds.count * sizeof(Feed) + 1);
+    if (sorted.feeds == NULL) {
+        perror("Error: couldn't allocate feeds.");
+        exit(1);
+    }
+    for (int run = 0; run < runs; run++) {
+        memcpy(sorted.feeds, feeds.feeds, feeds.count * sizeof(Feed));
+        Mapped_File output_file;
+        if (!bench_reset_file(output_path, "# Feeds\n\nWritten by the benchmark.\n\n" BENCH_FOREIGN_SECTION) ||
+            !map_file(output_path, &output_file)) {
+            rewrite.failed = 1;
+            break;
+        }
+        double start = bench_now();
+        qsort(sorted.feeds, sorted.count, sizeof(Feed), compare_feeds);
+        int written = write_sections(output_path, (Slice){ output_file.data, output_file.size }, &sorted, 1);
+        double seconds = bench_now() - start;
+        unmap_file(&output_file);
+        if (written != 1) rewrite.failed = 1;
+        if (run == 0 || seconds < rewrite.seconds) rewrite.seconds = seconds;
+    }
+
+    // Every feed is one list item in the output, next to the section the
+    // tool didn't write, kept as it was.
+    Mapped_File output_file;
+    if (!rewrite.failed && map_file(output_path, &output_file)) {
+        const char *p = output_file.data, *end = p + output_file.size;
+        while ((p = skip_past(p, end, "\n- ")) != NULL) rewrite.found++;
+        rewrite.found--;
+        rewrite.bytes = unchanged.bytes = output_file.size;
+        rewrite.failed = rewrite.found != corpus.expected.count ||
+                         skip_past(output_file.data, end, "\n" BENCH_FOREIGN_SECTION) == NULL;
+
+        unchanged.found = rewrite.found;
+        for (int run = 0; run < runs; run++) {
+            double start = bench_now();
+            int written = write_sections(output_path, (Slice){ output_file.data, output_file.size }, &sorted, 1);
+            double seconds = bench_now() - start;
+            if (written != 0) unchanged.failed = 1;
+            if (run == 0 || seconds < unchanged.seconds) unchanged.seconds = seconds;
+        }
+        unmap_file(&output_file);
+    } else {
+        rewrite.failed = unchanged.failed = 1;
+    }
+
+    bench_print(&corpus, &extract, csv);
+    bench_print(&corpus, &legacy, csv);
+    bench_print(&corpus, &rewrite, csv);
+    bench_print(&corpus, &unchanged, csv);
+
+    free(sorted.feeds);
+    feed_set_free(&feeds, 1);
+    category_list_free(&categories);
+    feed_set_free(&corpus.expected, 1);
+    category_list_free(&corpus.categories);
+    unlink(opml_path);
+    unlink(output_path);
+    return !extract.failed && !rewrite.failed && !unchanged.failed;
+}
+
+int bench_main(int argc, char *argv[]) {
+    const char *sizes = BENCH_SIZES;
+    int runs = 3;
+    int csv = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            sizes = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0) {
+            runs = parse_positive(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "text") == 0 || strcmp(argv[i + 1], "csv") == 0)) {
+            csv = strcmp(argv[++i], "csv") == 0;
+        } else {
+            fprintf(stderr, "Usage: %s --bench [--sizes N,...] [--runs N] [--format text|csv]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (csv) printf("outlines,stage,bytes,seconds,mbytes_per_second,outlines_per_second,found,missed,wrong,status\n");
+    int failed = 0;
+    for (const char *p = sizes; *p;) {
+        char *end;
+        unsigned long size = strtoul(p, &end, 10);
+        if (end == p || size < 1 || size > 10000000 || (*end != ',' && *end != 0)) {
+            fprintf(stderr, "Error: `--sizes` needs a list of feed counts.\n");
+            return 1;
+        }
+        if (!bench_size(size, runs, csv)) failed = 1;
+        fflush(stdout);
+        p = *end ? end + 1 : end;
+    }
+    return failed ? 2 : 0;
+}
+#endif // _WIN32
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "--check") == 0) {
+#ifdef OPML_CHECK
+        return check_main(argc, argv);
+#else
+        fprintf(stderr, "Error: --check is only supported on Linux.\n");
+        return 1;
+#endif // OPML_CHECK
+    }
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+#ifndef _WIN32
+        return bench_main(argc, argv);
+#else
+        fprintf(stderr, "Error: --bench isn't supported on Windows.\n");
+        return 1;
+#endif // _WIN32
+    }
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <opml_file>... <output_file>\n", argv[0]);
+        return 1;
+    }
+    const char *output_path = argv[argc - 1];
+
+    Mapped_File output_file;
+    if (!map_file(output_path, &output_file)) {
+        perror("Error: couldn't opening output file.");
+        return 1;
+    }
+
+    int input_count = argc - 2;
+    Opml_Input *inputs = calloc(input_count, sizeof(Opml_Input));
+    if (inputs == NULL) {
+        perror("Error: couldn't allocate inputs.");
+        return 1;
+    }
+    for (int i = 0; i < input_count; i++) inputs[i].path = argv[i + 1];
+    parse_inputs(inputs, input_count);
+
+    // Merge in argument order, so the first spelling of a feed, and its
+    // category, wins.
+    Feed_Set feeds = {0};
+    Category_List categories = {0};
+    for (int i = 0; i < input_count; i++) {
+        if (!inputs[i].ok) {
+            fprintf(stderr, "Error: couldn't opening opml file %s.\n", inputs[i].path);
+            return 1;
+        }
+        // Feeds of a category mostly come together, intern on a change.
+        const char *source = NULL, *category = NULL;
+        for (size_t j = 0; j < inputs[i].feeds.count; j++) {
+            Feed *feed = &inputs[i].feeds.feeds[j];
+            if (feed->category != source) {
+                source = feed->category;
+                category = category_intern(&categories, source, strlen(source));
+            }
+            feed->category = category;
+            if (!feed_set_add(&feeds, feed)) free(feed->url);
+        }
+        feed_set_free(&inputs[i].feeds, 0);
+        category_list_free(&inputs[i].categories);
+    }
+    free(inputs);
+    qsort(feeds.feeds, feeds.count, sizeof(Feed), compare_feeds);
+
+    Slice doc = { output_file.data, output_file.size };
+    int written = write_sections(output_path, doc, &feeds, 0);
+    if (written < 0) {
+        perror("Error: couldn't write output file.");
+        return 1;
     }
+    if (written == 0) printf("%s is up to date.\n", output_path);
 
-    fclose(opml_file);
-    fclose(output_file);
-    fclose(temp_file);
+    category_list_free(&categories);
+    feed_set_free(&feeds, 1);
+    unmap_file(&output_file);
     return 0;
 }
@@ -22,16 +22,194 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+// Compile:
+//      GCC:    cc -O2 x11-fps.c -lX11 -lXext -lxcb -lm -pthread -o x11-fps
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 
-#include <sys/time.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <xcb/xcb.h>
 
-struct {
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif // __SSE2__
+
+static const char *help_message = "Measures image upload throughput of the X server.\n\n"
+"Usage:\n"
+"   x11-fps [OPTIONS]\n"
+"Options:\n"
+"   --shm               Upload with XShmPutImage from shared memory instead of XPutImage\n"
+"   --xcb               Upload with pipelined xcb_put_image requests on a separate\n"
+"                       XCB connection instead of Xlib\n"
+"   --in-flight FRAMES  Frames the XCB backend may have queued in the server\n"
+"                       before it waits for the oldest one (default: 2)\n"
+"   --produce THREADS   Render animated frames on THREADS threads into two\n"
+"                       alternating back buffers while the front one is uploaded\n"
+"   --damage FRACTION   Upload only FRACTION of the window's tiles each frame,\n"
+"                       picked at random, instead of the whole window\n"
+"   --tile SIZE         Tile size in pixels for --damage (default: 64)\n"
+"   --merge             Merge adjacent damaged tiles into larger rectangles\n"
+"   --rects LIST        Upload only these rectangles each frame, given as WxH+X+Y\n"
+"   --hugepages MODE    Back frames with hugepages: none, thp (transparent),\n"
+"                       explicit (MAP_HUGETLB/SHM_HUGETLB) (default: none)\n"
+"   -h --help           Print help\n"
+"Benchmark options:\n"
+"   --bench             Run every combination of the options below without\n"
+"                       interaction, print the results and exit\n"
+"   --sizes LIST        Window sizes (default: 640x480,1280x720,1920x1080)\n"
+"   --depths LIST       Pixel depths, 0 is the default visual (default: 0)\n"
+"   --methods LIST      Upload methods: socket, shm, xcb (default: socket,shm)\n"
+"   --duration SECONDS  Measured time of each configuration (default: 5)\n"
+"   --warmup SECONDS    Unmeasured time before each configuration (default: 1)\n"
+"   --clients LIST      Numbers of clients uploading at the same time, each on a\n"
+"                       thread with its own connection and window; without\n"
+"                       --bench the first one is used (default: 1)\n"
+"   --format FORMAT     Output format: csv, json (default: csv)\n\n"
+"Frame time percentiles are printed every half second, the whole\n"
+"distribution when the window is closed or on Ctrl-C.\n"
+"The benchmark runs fine under Xvfb, e.g.\n"
+"   xvfb-run -s '-screen 0 1920x1080x24' x11-fps --bench\n";
+
+#define MAX_FRAMES 3
+
+// Frames are views into grow-only buffers: a resize only creates a new
+// image header unless the window outgrew `capacity`.
+struct frame_buffer {
+    XImage* image;
+    char* buffer;
+    XShmSegmentInfo shm_info;
+    char* pool;
+    size_t capacity;
+    int pool_shm;
+    int pool_mapped;
+};
+
+enum hugepages {
+    HUGEPAGES_NONE,
+    HUGEPAGES_THP,
+    HUGEPAGES_EXPLICIT
+};
+
+#define POOL_ALIGNMENT 64
+#define HUGEPAGE_SIZE (2 << 20)
+
+#define MAX_IN_FLIGHT 64
+
+// XCB backend. It has a connection and window of its own and shares only
+// the frame buffers and the counter with the Xlib one.
+struct fps_xcb {
+    int enabled;
+    int in_flight;
+    xcb_connection_t * connection;
+    xcb_screen_t * screen;
+    xcb_window_t window;
+    xcb_gcontext_t gc;
+    xcb_atom_t delete_window;
+    unsigned int max_request_bytes;
+    int scanline_pad;
+    // Rows of partial rectangles are packed here before upload.
+    unsigned char * scratch;
+    size_t scratch_size;
+    // A GetInputFocus round trip after each frame; its reply means the
+    // server has handled every put_image of that frame.
+    xcb_get_input_focus_cookie_t fences[MAX_IN_FLIGHT];
+    int fence_first;
+    int fence_count;
+};
+
+// Log-linear histogram of nanosecond values in the spirit of HdrHistogram:
+// every power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets, so
+// any recorded value is off by at most 1/HISTOGRAM_SUB_BUCKETS.
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+    unsigned long long total;
+    unsigned long long max;
+    double sum;
+    double sum_squares;
+};
+
+#define MAX_PRODUCER_THREADS 64
+
+struct fps_app;
+
+struct producer_worker {
+    struct fps_app * app;
+    int index;
+};
+
+// Renders animated frames on `threads` threads. Frames rotate through three
+// buffers: the front one is uploaded, `ready` holds the newest complete
+// frame and `back` is being rendered.
+struct fps_producer {
+    int threads;
+    pthread_t ids[MAX_PRODUCER_THREADS];
+    struct producer_worker workers[MAX_PRODUCER_THREADS];
+    pthread_barrier_t barrier;
+    pthread_mutex_t lock;
+    int back;
+    int ready;
+    int fresh;
+    int stop;
+    int quitting;
+    unsigned int time;
+    unsigned int * columns;
+    unsigned long long produced;
+};
+
+#define MAX_BENCH_ITEMS 32
+
+// Rectangles uploaded each frame, the whole window unless --damage or
+// --rects is given.
+struct fps_damage {
+    double fraction;
+    int tile;
+    int merge;
+    int fixed[MAX_BENCH_ITEMS][4];
+    int fixed_count;
+
+    XRectangle * rects;
+    int rect_count;
+    int rect_capacity;
+    unsigned long long pixels;
+
+    // Tile grid for --damage, `tiles` is a permutation of its indices.
+    int columns;
+    int rows;
+    int * tiles;
+    unsigned char * marks;
+    unsigned int seed;
+};
+
+struct fps_counter {
+    int ticks;
+    unsigned long long frames;
+    unsigned long long pixels;
+    unsigned long long period_pixels;
+    unsigned long long produced;
+    unsigned long long show_nanos;
+    unsigned long long frame_nanos;
+    struct histogram period;
+    struct histogram all;
+};
+
+struct fps_app {
+    int client;
     int width;
     int height;
 
@@ -40,175 +218,1531 @@ struct {
     int screen;
     Window root;
     Window window;
+    Colormap colormap;
+    Atom delete_window;
     GC gc;
 
+    // Front frame, the one uploaded to the window.
     XImage* pixmap;
     char* pixmap_buffer;
     int depth;
     int pixmap_buffer_size;
-} fps_app;
+    int stride;
+    int bits_per_pixel;
+
+    struct frame_buffer frames[MAX_FRAMES];
+    int frame_count;
+    int front;
+
+    int hugepages;
+    int use_shm;
+    int shm_available;
+    int shm_completion;
+    int shm_pending;
+
+    struct fps_xcb xcb;
+    struct fps_producer producer;
+    struct fps_damage damage;
+    struct fps_counter counter;
+};
+
+static const unsigned long long REFRESH_PERIOD_NS = 500000000ULL;
+
+static volatile sig_atomic_t should_quit = 0;
+
+#define MAX_CLIENTS 256
+
+// Options every client starts from, and the clients themselves.
+static struct fps_app fps_options;
+
+struct fps_client {
+    pthread_t thread;
+    struct fps_app app;
+    int method;
+    int width;
+    int height;
+    int depth;
+    int ok;
+    double elapsed_s;
+};
 
 struct {
-    int ticks;
-    unsigned long long show_millis;
-} fps_counter;
+    struct fps_client * clients;
+    int count;
+    // Clients that set up their window, the others are left out of the
+    // results.
+    int running;
+    pthread_barrier_t barrier;
+} fps_clients;
+
+enum upload_method {
+    UPLOAD_SOCKET,
+    UPLOAD_SHM,
+    UPLOAD_XCB,
+    UPLOAD_METHOD_COUNT
+};
+
+static const char * upload_method_names[UPLOAD_METHOD_COUNT] = {
+    "socket", "shm", "xcb"
+};
 
-static const int REFRESH_PERIOD_MS = 500;
+struct {
+    int enabled;
+    int json;
+    int quiet;
+    int sizes[MAX_BENCH_ITEMS][2];
+    int size_count;
+    int depths[MAX_BENCH_ITEMS];
+    int depth_count;
+    int methods[MAX_BENCH_ITEMS];
+    int method_count;
+    int clients[MAX_BENCH_ITEMS];
+    int client_count;
+    double duration;
+    double warmup;
+} fps_bench;
+
+static unsigned long long monotonic_nanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int histogram_index(unsigned long long value) {
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) return value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    int index = (shift + 1) * HISTOGRAM_SUB_BUCKETS + (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+    // Values from 2^63 up are past the last power of two, they go in the
+    // top bucket.
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// Lowest value which lands in bucket `index`.
+static unsigned long long histogram_value(int index) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS) return index;
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    return (unsigned long long) (index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+static void histogram_reset(struct histogram * h) {
+    memset(h, 0, sizeof(*h));
+}
 
-static long epoch_millis() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+static void histogram_record(struct histogram * h, unsigned long long value) {
+    h->counts[histogram_index(value)]++;
+    h->total++;
+    h->sum += value;
+    h->sum_squares += (double) value * value;
+    if (value > h->max) h->max = value;
 }
 
-static void x_connect () {
-    fps_app.display = XOpenDisplay (NULL);
-    if (!fps_app.display) {
+static unsigned long long histogram_percentile(const struct histogram * h, double percentile) {
+    unsigned long long target = (unsigned long long) (h->total * percentile / 100.0 + 0.5);
+    unsigned long long seen = 0;
+    if (target == 0) target = 1;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) return histogram_value(i);
+    }
+    return h->max;
+}
+
+// Standard deviation of the recorded values.
+static double histogram_jitter(const struct histogram * h) {
+    if (h->total < 2) return 0;
+    double mean = h->sum / h->total;
+    double variance = h->sum_squares / h->total - mean * mean;
+    return variance > 0 ? sqrt(variance) : 0;
+}
+
+static void histogram_merge(struct histogram * h, const struct histogram * other) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) h->counts[i] += other->counts[i];
+    h->total += other->total;
+    if (other->max > h->max) h->max = other->max;
+    h->sum += other->sum;
+    h->sum_squares += other->sum_squares;
+}
+
+static void histogram_dump(const struct histogram * h) {
+    unsigned long long seen = 0;
+    printf("frame time distribution (%llu frames):\n", h->total);
+    printf("%14s %10s %10s\n", "from_ms", "count", "percentile");
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (!h->counts[i]) continue;
+        seen += h->counts[i];
+        printf("%14.6f %10llu %10.4f\n",
+               histogram_value(i) / 1e6, h->counts[i], 100.0 * seen / h->total);
+    }
+}
+
+static void x_connect (struct fps_app * app) {
+    app->display = XOpenDisplay (NULL);
+    if (!app->display) {
         fprintf (stderr, "Could not open display.\n");
         exit (1);
     }
-    fps_app.screen = DefaultScreen (fps_app.display);
-    fps_app.root = RootWindow (fps_app.display, fps_app.screen);
+    app->screen = DefaultScreen (app->display);
+    app->root = RootWindow (app->display, app->screen);
+    app->visual = DefaultVisual (app->display, app->screen);
+
+    app->shm_available = XShmQueryExtension (app->display);
+    if (app->shm_available) {
+        app->shm_completion = XShmGetEventBase (app->display) + ShmCompletion;
+    } else if (app->use_shm) {
+        fprintf (stderr, "MIT-SHM extension is not available.\n");
+        exit (1);
+    }
 }
 
-static void create_window () {
+// Creates the window with a TrueColor visual of `depth`, or with the default
+// visual when `depth` is 0. Returns 0 when there is no such visual.
+static int create_window (struct fps_app * app, int width, int height, int depth) {
     unsigned long xAttrMask = CWBackPixel;
     XSetWindowAttributes xAttr;
+    int window_depth = CopyFromParent;
+    memset(&xAttr, 0, sizeof(xAttr));
+
+    app->width = width;
+    app->height = height;
+    app->visual = DefaultVisual (app->display, app->screen);
+    app->colormap = None;
 
-    fps_app.width = 400;
-    fps_app.height = 300;
+    if (depth) {
+        XVisualInfo info;
+        if (!XMatchVisualInfo(app->display, app->screen, depth, TrueColor, &info)) {
+            return 0;
+        }
+        app->visual = info.visual;
+        app->colormap = XCreateColormap(app->display, app->root, info.visual, AllocNone);
+        xAttr.colormap = app->colormap;
+        xAttrMask |= CWColormap | CWBorderPixel;
+        window_depth = depth;
+    }
 
-    fps_app.window =
-            XCreateWindow(fps_app.display,
-                          DefaultRootWindow(fps_app.display),
+    app->window =
+            XCreateWindow(app->display,
+                          DefaultRootWindow(app->display),
                           0, 0,
-                          fps_app.width, fps_app.height, 0, CopyFromParent, CopyFromParent,
-                          fps_app.visual,
+                          app->width, app->height, 0, window_depth, CopyFromParent,
+                          app->visual,
                           xAttrMask, &xAttr);
 
-    XStoreName(fps_app.display, fps_app.window, "x11_fps");
+    XStoreName(app->display, app->window, "x11_fps");
+
 
+    XSelectInput (app->display, app->window, ExposureMask|StructureNotifyMask);
+    XMapWindow (app->display, app->window);
 
-    XSelectInput (fps_app.display, fps_app.window, ExposureMask|StructureNotifyMask);
-    XMapWindow (fps_app.display, fps_app.window);
+    app->delete_window = XInternAtom(app->display, "WM_DELETE_WINDOW", False);
+    XSetWMProtocols(app->display, app->window, &app->delete_window, 1);
 
     XWindowAttributes windowAttributes;
-    if (!XGetWindowAttributes(fps_app.display, fps_app.window, &windowAttributes)) {
+    if (!XGetWindowAttributes(app->display, app->window, &windowAttributes)) {
         fprintf (stderr, "Could not get window attributes.\n");
         exit (1);
     }
-    fps_app.depth = windowAttributes.depth;
+    app->depth = windowAttributes.depth;
+    return 1;
+}
 
+static void destroy_window (struct fps_app * app) {
+    XFreeGC (app->display, app->gc);
+    XDestroyWindow (app->display, app->window);
+    if (app->colormap != None) XFreeColormap (app->display, app->colormap);
+    // Drop what is still queued for the old window.
+    XSync (app->display, True);
 }
 
-static void set_up_gc () {
-    fps_app.screen = DefaultScreen (fps_app.display);
-    fps_app.gc = XCreateGC (fps_app.display, fps_app.window, 0, 0);
+static void set_up_gc (struct fps_app * app) {
+    app->screen = DefaultScreen (app->display);
+    app->gc = XCreateGC (app->display, app->window, 0, 0);
 }
 
-static void set_up_counter() {
-    fps_counter.ticks = 0;
-    fps_counter.show_millis = epoch_millis();
+// Rounds a new pool buffer up to half again the size asked for, so
+// dragging a window edge outwards doesn't grow it on every step.
+static size_t pool_capacity(struct fps_app * app, size_t size) {
+    size_t granule = app->hugepages ? HUGEPAGE_SIZE : POOL_ALIGNMENT;
+    size += size / 2;
+    return (size + granule - 1) / granule * granule;
 }
 
-static void set_up_pixmap() {
-    const int bytes_per_pixel = 4;
-    fps_app.pixmap_buffer_size = fps_app.width * fps_app.height * bytes_per_pixel;
-    fps_app.pixmap_buffer = malloc(fps_app.pixmap_buffer_size);
-    memset(fps_app.pixmap_buffer, 255, fps_app.pixmap_buffer_size);
+static void release_pool(struct fps_app * app, struct frame_buffer * frame) {
+    if (!frame->capacity) return;
 
-    fps_app.pixmap = XCreateImage(
-            fps_app.display,
-            fps_app.visual,
-            fps_app.depth, ZPixmap,
-            0, (char*) fps_app.pixmap_buffer,
-            fps_app.width, fps_app.height,
-            8 * bytes_per_pixel, 0);
+    if (frame->pool_shm) {
+        XShmDetach(app->display, &frame->shm_info);
+        XSync(app->display, False);
+        shmdt(frame->shm_info.shmaddr);
+    } else if (frame->pool_mapped) {
+        munmap(frame->pool, frame->capacity);
+    } else {
+        free(frame->pool);
+    }
+    frame->pool = NULL;
+    frame->capacity = 0;
 }
 
-static void touch_fps_counter() {
-    const int msecs_in_second = 1000;
-    unsigned long now_ms = epoch_millis();
-    unsigned long refresh_delta_ms = now_ms - fps_counter.show_millis;
+static void reserve_shm_pool(struct fps_app * app, struct frame_buffer * frame, size_t capacity) {
+    int flags = IPC_CREAT | 0600;
+    if (app->hugepages == HUGEPAGES_EXPLICIT) flags |= SHM_HUGETLB;
 
-    ++fps_counter.ticks;
-    if (refresh_delta_ms >= REFRESH_PERIOD_MS) {
-        char text[80];
-        float fps = (float) msecs_in_second * fps_counter.ticks / refresh_delta_ms;
-        float throughput_mbytes_per_second =
-                (float) 1e-6 * msecs_in_second * fps_app.pixmap_buffer_size * fps_counter.ticks / refresh_delta_ms;
+    frame->shm_info.shmid = shmget(IPC_PRIVATE, capacity, flags);
+    if (frame->shm_info.shmid < 0 && app->hugepages == HUGEPAGES_EXPLICIT) {
+        fprintf (stderr, "No hugepages for shared memory, using normal pages.\n");
+        frame->shm_info.shmid = shmget(IPC_PRIVATE, capacity, IPC_CREAT | 0600);
+    }
+    if (frame->shm_info.shmid < 0) {
+        perror ("Could not create shared memory segment");
+        exit (1);
+    }
 
-        sprintf(text,
-               "[%dx%d] fps: %.2f throughput: %.2f megabytes/sec",
-               fps_app.width,
-               fps_app.height,
-               fps,
-               throughput_mbytes_per_second
-        );
+    frame->shm_info.shmaddr = shmat(frame->shm_info.shmid, NULL, 0);
+    if (frame->shm_info.shmaddr == (char*) -1) {
+        perror ("Could not attach shared memory segment");
+        exit (1);
+    }
+    frame->shm_info.readOnly = True;
+    if (app->hugepages == HUGEPAGES_THP) {
+        madvise(frame->shm_info.shmaddr, capacity, MADV_HUGEPAGE);
+    }
 
-        XStoreName(fps_app.display, fps_app.window, text);
-        fps_counter.ticks = 0;
-        fps_counter.show_millis = now_ms;
+    if (!XShmAttach(app->display, &frame->shm_info)) {
+        fprintf (stderr, "Could not attach shared memory segment to the server.\n");
+        exit (1);
     }
+    XSync(app->display, False);
+
+    // Freed once both the server and we have detached.
+    shmctl(frame->shm_info.shmid, IPC_RMID, NULL);
+    frame->pool = frame->shm_info.shmaddr;
 }
 
-static void reset_fps_counter() {
-    fps_counter.ticks = 0;
-    fps_counter.show_millis = epoch_millis();
+static void reserve_heap_pool(struct fps_app * app, struct frame_buffer * frame, size_t capacity) {
+    frame->pool_mapped = app->hugepages != HUGEPAGES_NONE;
+    if (!frame->pool_mapped) {
+        if (posix_memalign((void **) &frame->pool, POOL_ALIGNMENT, capacity)) {
+            fprintf (stderr, "Could not allocate frame.\n");
+            exit (1);
+        }
+        return;
+    }
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    frame->pool = MAP_FAILED;
+    if (app->hugepages == HUGEPAGES_EXPLICIT) {
+        frame->pool = mmap(NULL, capacity, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (frame->pool == MAP_FAILED) {
+            fprintf (stderr, "No hugepages for frames, using normal pages.\n");
+        }
+    }
+    if (frame->pool == MAP_FAILED) {
+        frame->pool = mmap(NULL, capacity, PROT_READ | PROT_WRITE, flags, -1, 0);
+    }
+    if (frame->pool == MAP_FAILED) {
+        perror ("Could not map frame");
+        exit (1);
+    }
+    if (app->hugepages == HUGEPAGES_THP) {
+        madvise(frame->pool, capacity, MADV_HUGEPAGE);
+    }
 }
 
-static void draw_screen() {
-    if (XPutImage(fps_app.display,
-              fps_app.window,
-              fps_app.gc,
-              fps_app.pixmap, 0,0,0,0,
-              fps_app.pixmap->width,
-              fps_app.pixmap->height)) {
+// Makes `frame` hold at least `size` bytes, only allocating when it has
+// to grow or when the upload method changed.
+static void reserve_pool(struct fps_app * app, struct frame_buffer * frame, size_t size, int shm) {
+    if (size <= frame->capacity && shm == frame->pool_shm) return;
 
-        fprintf (stderr, "Could not draw image\n");
+    release_pool(app, frame);
+    size_t capacity = pool_capacity(app, size);
+    frame->pool_shm = shm;
+    if (shm) {
+        reserve_shm_pool(app, frame, capacity);
+    } else {
+        reserve_heap_pool(app, frame, capacity);
+    }
+    frame->capacity = capacity;
+    // Touch every page now rather than during the measurement.
+    memset(frame->pool, 255, capacity);
+}
+
+static void set_up_frame(struct fps_app * app, struct frame_buffer * frame) {
+    // Let Xlib work out the row size, it depends on the depth.
+    if (app->use_shm) {
+        frame->image = XShmCreateImage(
+                app->display,
+                app->visual,
+                app->depth, ZPixmap,
+                NULL, &frame->shm_info,
+                app->width, app->height);
+    } else {
+        frame->image = XCreateImage(
+                app->display,
+                app->visual,
+                app->depth, ZPixmap,
+                0, NULL,
+                app->width, app->height,
+                32, 0);
+    }
+    if (!frame->image) {
+        fprintf (stderr, "Could not create image.\n");
         exit (1);
+    }
+
+    app->pixmap_buffer_size = frame->image->bytes_per_line * app->height;
+    reserve_pool(app, frame, app->pixmap_buffer_size, app->use_shm);
+    frame->buffer = frame->image->data = frame->pool;
+}
+
+static void tear_down_frame(struct frame_buffer * frame) {
+    // The pool outlives the image.
+    frame->image->data = NULL;
+    XDestroyImage(frame->image);
+}
+
+static void set_front_frame(struct fps_app * app, int front) {
+    app->front = front;
+    app->pixmap = app->frames[front].image;
+    app->pixmap_buffer = app->frames[front].buffer;
+}
+
+static void set_up_pixmap(struct fps_app * app) {
+    app->frame_count = app->producer.threads ? MAX_FRAMES : 1;
+    for (int i = 0; i < app->frame_count; i++) {
+        set_up_frame(app, &app->frames[i]);
+    }
+    app->stride = app->frames[0].image->bytes_per_line;
+    app->bits_per_pixel = app->frames[0].image->bits_per_pixel;
+    set_front_frame(app, 0);
+}
+
+static void tear_down_pixmap(struct fps_app * app) {
+    if (app->use_shm) {
+        // The server may still be reading a segment.
+        XSync(app->display, False);
+        app->shm_pending = 0;
+    }
+
+    for (int i = 0; i < app->frame_count; i++) {
+        tear_down_frame(&app->frames[i]);
+    }
+}
+
+static void release_pixmap(struct fps_app * app) {
+    for (int i = 0; i < MAX_FRAMES; i++) {
+        release_pool(app, &app->frames[i]);
+    }
+}
+
+// Fills rows [first_row, last_row) of `frame` with the column table offset by a per row value,
+// adding each of the four bytes separately so channels don't carry over.
+static void produce_rows(struct fps_app * app, char * frame, int stride, int first_row, int last_row) {
+    static const unsigned char wave[16] = {
+        128, 177, 218, 245, 255, 245, 218, 177, 128, 79, 38, 11, 1, 11, 38, 79
     };
+    const unsigned int * columns = app->producer.columns;
+    unsigned int t = app->producer.time;
+
+    for (int y = first_row; y < last_row; y++) {
+        unsigned int * row = (unsigned int *) (frame + (size_t) y * stride);
+        unsigned int row_value =
+                (wave[((y >> 4) + t) & 15] >> 1) << 16 |
+                (wave[((y >> 5) + 2 * t) & 15] >> 1) << 8 |
+                (wave[((y >> 3) + 3 * t) & 15] >> 1);
+        int x = 0;
+#ifdef __SSE2__
+        __m128i add = _mm_set1_epi32(row_value);
+        for (; x + 4 <= app->width; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (columns + x));
+            _mm_storeu_si128((__m128i *) (row + x), _mm_add_epi8(v, add));
+        }
+#endif // __SSE2__
+        for (; x < app->width; x++) {
+            unsigned int a = columns[x], b = row_value;
+            row[x] = ((a & 0x7f7f7f7f) + (b & 0x7f7f7f7f)) ^ ((a ^ b) & 0x80808080);
+        }
+    }
+}
+
+static void produce_columns(struct fps_app * app) {
+    unsigned int t = app->producer.time;
+    for (int x = 0; x < app->width; x++) {
+        unsigned int phase = (x * 256 / (app->width ? app->width : 1) + t * 3) & 255;
+        unsigned int tri = phase < 128 ? phase : 255 - phase;
+        app->producer.columns[x] = (tri << 16) | ((255 - tri) << 8) | ((phase + t) & 127);
+    }
+}
+
+static void * producer_thread(void * arg) {
+    const struct producer_worker * worker = arg;
+    struct fps_app * app = worker->app;
+    int index = worker->index;
+    int stride = app->stride;
+
+    while (1) {
+        int first_row = app->height * index / app->producer.threads;
+        int last_row = app->height * (index + 1) / app->producer.threads;
+        produce_rows(app, app->frames[app->producer.back].buffer, stride, first_row, last_row);
+
+        // One thread publishes the frame and prepares the next one while
+        // the others wait at the second barrier.
+        if (pthread_barrier_wait(&app->producer.barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            pthread_mutex_lock(&app->producer.lock);
+            int ready = app->producer.ready;
+            app->producer.ready = app->producer.back;
+            app->producer.back = ready;
+            app->producer.fresh = 1;
+            app->producer.produced++;
+            pthread_mutex_unlock(&app->producer.lock);
+
+            app->producer.time++;
+            produce_columns(app);
+            // Decided here so every thread leaves after the same frame.
+            app->producer.quitting = __atomic_load_n(&app->producer.stop, __ATOMIC_ACQUIRE);
+        }
+        pthread_barrier_wait(&app->producer.barrier);
+
+        if (app->producer.quitting) break;
+    }
+    return NULL;
+}
+
+static void start_producer(struct fps_app * app) {
+    if (!app->producer.threads) return;
+    if (app->bits_per_pixel != 32) {
+        fprintf (stderr, "The producer needs 32 bits per pixel, got %d.\n",
+                 app->bits_per_pixel);
+        exit (1);
+    }
+
+    app->producer.columns = malloc((app->width + 4) * sizeof(unsigned int));
+    if (!app->producer.columns) {
+        fprintf (stderr, "Could not allocate producer columns.\n");
+        exit (1);
+    }
+    app->producer.back = 2;
+    app->producer.ready = 1;
+    app->producer.fresh = 0;
+    app->producer.stop = 0;
+    app->producer.quitting = 0;
+    app->producer.produced = 0;
+    produce_columns(app);
+
+    pthread_mutex_init(&app->producer.lock, NULL);
+    pthread_barrier_init(&app->producer.barrier, NULL, app->producer.threads);
+    for (int i = 0; i < app->producer.threads; i++) {
+        app->producer.workers[i].app = app;
+        app->producer.workers[i].index = i;
+        if (pthread_create(&app->producer.ids[i], NULL, producer_thread, &app->producer.workers[i])) {
+            fprintf (stderr, "Could not start producer thread.\n");
+            exit (1);
+        }
+    }
+}
+
+static void stop_producer(struct fps_app * app) {
+    if (!app->producer.threads) return;
+
+    __atomic_store_n(&app->producer.stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < app->producer.threads; i++) {
+        pthread_join(app->producer.ids[i], NULL);
+    }
+    pthread_barrier_destroy(&app->producer.barrier);
+    pthread_mutex_destroy(&app->producer.lock);
+    free(app->producer.columns);
+}
+
+// Makes the newest produced frame the front one, if there is one.
+static void present_produced_frame(struct fps_app * app) {
+    if (!app->producer.threads) return;
+
+    pthread_mutex_lock(&app->producer.lock);
+    if (app->producer.fresh) {
+        int front = app->producer.ready;
+        app->producer.ready = app->front;
+        app->producer.fresh = 0;
+        set_front_frame(app, front);
+    }
+    pthread_mutex_unlock(&app->producer.lock);
+}
+
+static unsigned long long produced_frames(struct fps_app * app) {
+    if (!app->producer.threads) return 0;
+
+    pthread_mutex_lock(&app->producer.lock);
+    unsigned long long produced = app->producer.produced;
+    pthread_mutex_unlock(&app->producer.lock);
+    return produced;
+}
+
+static void add_damage_rect(struct fps_app * app, int x, int y, int width, int height) {
+    if (app->damage.rect_count == app->damage.rect_capacity) {
+        app->damage.rect_capacity = app->damage.rect_capacity ? 2 * app->damage.rect_capacity : 64;
+        app->damage.rects = realloc(app->damage.rects, app->damage.rect_capacity * sizeof(XRectangle));
+        if (!app->damage.rects) {
+            fprintf (stderr, "Could not allocate damage rectangles.\n");
+            exit (1);
+        }
+    }
+    XRectangle * rect = &app->damage.rects[app->damage.rect_count++];
+    rect->x = x;
+    rect->y = y;
+    rect->width = width;
+    rect->height = height;
+}
+
+static unsigned int damage_random(struct fps_app * app) {
+    unsigned int x = app->damage.seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return app->damage.seed = x;
+}
+
+// Picks `fraction` of the tiles with a partial Fisher-Yates shuffle and
+// turns them into rectangles in row-major order. With --merge, runs of
+// tiles in a row become one rectangle, which is extended downwards while
+// the rows below have a run of the same span.
+static void damage_tiles(struct fps_app * app) {
+    int tile = app->damage.tile;
+    int columns = (app->width + tile - 1) / tile;
+    int rows = (app->height + tile - 1) / tile;
+    int total = columns * rows;
+
+    if (columns != app->damage.columns || rows != app->damage.rows) {
+        app->damage.columns = columns;
+        app->damage.rows = rows;
+        app->damage.tiles = realloc(app->damage.tiles, total * sizeof(int));
+        app->damage.marks = realloc(app->damage.marks, total);
+        if (!app->damage.tiles || !app->damage.marks) {
+            fprintf (stderr, "Could not allocate damage tiles.\n");
+            exit (1);
+        }
+        for (int i = 0; i < total; i++) app->damage.tiles[i] = i;
+    }
+
+    int count = total * app->damage.fraction + 0.5;
+    if (count < 1) count = 1;
+    memset(app->damage.marks, 0, total);
+    for (int i = 0; i < count; i++) {
+        int j = i + damage_random(app) % (total - i);
+        int t = app->damage.tiles[i];
+        app->damage.tiles[i] = app->damage.tiles[j];
+        app->damage.tiles[j] = t;
+        app->damage.marks[app->damage.tiles[i]] = 1;
+    }
+
+    for (int ty = 0; ty < rows; ty++) {
+        const unsigned char * marks = app->damage.marks + ty * columns;
+        int row_first = app->damage.rect_count;
+        int y = ty * tile;
+        int height = y + tile > app->height ? app->height - y : tile;
+
+        for (int tx = 0; tx < columns;) {
+            if (!marks[tx]) {
+                tx++;
+                continue;
+            }
+            int end = tx + 1;
+            if (app->damage.merge) {
+                while (end < columns && marks[end]) end++;
+            }
+            int x = tx * tile;
+            int width = (end * tile > app->width ? app->width : end * tile) - x;
+            tx = end;
+
+            int merged = 0;
+            for (int k = 0; app->damage.merge && k < row_first; k++) {
+                XRectangle * rect = &app->damage.rects[k];
+                if (rect->x == x && rect->width == width && rect->y + rect->height == y) {
+                    rect->height += height;
+                    merged = 1;
+                    break;
+                }
+            }
+            if (!merged) add_damage_rect(app, x, y, width, height);
+        }
+    }
+}
+
+// Works out the rectangles of the next frame.
+static void update_damage(struct fps_app * app) {
+    app->damage.rect_count = 0;
+
+    if (app->damage.fixed_count) {
+        for (int i = 0; i < app->damage.fixed_count; i++) {
+            const int * fixed = app->damage.fixed[i];
+            int x = fixed[2], y = fixed[3];
+            int right = x + fixed[0] > app->width ? app->width : x + fixed[0];
+            int bottom = y + fixed[1] > app->height ? app->height : y + fixed[1];
+            if (right > x && bottom > y) add_damage_rect(app, x, y, right - x, bottom - y);
+        }
+    } else if (app->damage.fraction > 0) {
+        damage_tiles(app);
+    } else {
+        add_damage_rect(app, 0, 0, app->width, app->height);
+    }
+
+    app->damage.pixels = 0;
+    for (int i = 0; i < app->damage.rect_count; i++) {
+        app->damage.pixels += app->damage.rects[i].width * app->damage.rects[i].height;
+    }
+}
+
+static void set_up_counter(struct fps_app * app) {
+    app->counter.ticks = 0;
+    app->counter.frames = 0;
+    app->counter.pixels = 0;
+    app->counter.period_pixels = 0;
+    app->counter.show_nanos = monotonic_nanos();
+    app->counter.frame_nanos = 0;
+    app->counter.produced = produced_frames(app);
+    histogram_reset(&app->counter.period);
+    histogram_reset(&app->counter.all);
+}
+
+static void touch_fps_counter(struct fps_app * app) {
+    const double nsecs_in_second = 1e9;
+    unsigned long long now_ns = monotonic_nanos();
+    unsigned long long refresh_delta_ns = now_ns - app->counter.show_nanos;
+
+    if (app->counter.frame_nanos) {
+        unsigned long long frame_ns = now_ns - app->counter.frame_nanos;
+        histogram_record(&app->counter.period, frame_ns);
+        histogram_record(&app->counter.all, frame_ns);
+    }
+    app->counter.frame_nanos = now_ns;
+
+    ++app->counter.ticks;
+    ++app->counter.frames;
+    app->counter.pixels += app->damage.pixels;
+    app->counter.period_pixels += app->damage.pixels;
+    if (refresh_delta_ns >= REFRESH_PERIOD_NS) {
+        char text[320];
+        const struct histogram * h = &app->counter.period;
+        float fps = nsecs_in_second * app->counter.ticks / refresh_delta_ns;
+        float mpixels_per_second = 1e-6 * nsecs_in_second * app->counter.period_pixels / refresh_delta_ns;
+        float throughput_mbytes_per_second = mpixels_per_second * app->bits_per_pixel / 8;
+        unsigned long long produced = produced_frames(app);
+        float produce_fps = nsecs_in_second * (produced - app->counter.produced) / refresh_delta_ns;
+
+        snprintf(text, sizeof(text),
+               "[%dx%d] %s fps: %.2f throughput: %.2f megabytes/sec %.2f megapixels/sec produce fps: %.2f "
+               "frame ms p50: %.2f p90: %.2f p99: %.2f max: %.2f jitter: %.2f",
+               app->width,
+               app->height,
+               app->xcb.connection ? "xcb" : app->use_shm ? "shm" : "socket",
+               fps,
+               throughput_mbytes_per_second,
+               mpixels_per_second,
+               produce_fps,
+               histogram_percentile(h, 50) / 1e6,
+               histogram_percentile(h, 90) / 1e6,
+               histogram_percentile(h, 99) / 1e6,
+               h->max / 1e6,
+               histogram_jitter(h) / 1e6
+        );
+
+        if (app->xcb.connection) {
+            xcb_change_property(app->xcb.connection, XCB_PROP_MODE_REPLACE, app->xcb.window,
+                                XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, strlen(text), text);
+        } else {
+            XStoreName(app->display, app->window, text);
+        }
+        if (!fps_bench.quiet) {
+            if (fps_clients.count > 1) printf("client %d: ", app->client);
+            printf("%s\n", text);
+            fflush(stdout);
+        }
+
+        app->counter.ticks = 0;
+        app->counter.period_pixels = 0;
+        app->counter.show_nanos = now_ns;
+        app->counter.produced = produced;
+        histogram_reset(&app->counter.period);
+    }
+}
+
+static void reset_fps_counter(struct fps_app * app) {
+    app->counter.ticks = 0;
+    app->counter.period_pixels = 0;
+    app->counter.show_nanos = monotonic_nanos();
+    app->counter.frame_nanos = 0;
+    app->counter.produced = produced_frames(app);
+    histogram_reset(&app->counter.period);
+}
+
+static void draw_screen(struct fps_app * app) {
+    if (app->use_shm) {
+        for (int i = 0; i < app->damage.rect_count; i++) {
+            const XRectangle * rect = &app->damage.rects[i];
+            // Ask for a ShmCompletion event after the last rectangle, the
+            // buffer isn't touched again before the server is done reading it.
+            if (!XShmPutImage(app->display,
+                              app->window,
+                              app->gc,
+                              app->pixmap,
+                              rect->x, rect->y, rect->x, rect->y,
+                              rect->width,
+                              rect->height,
+                              i == app->damage.rect_count - 1)) {
+                fprintf (stderr, "Could not draw image\n");
+                exit (1);
+            }
+        }
+        app->shm_pending = app->damage.rect_count > 0;
+        return;
+    }
+
+    for (int i = 0; i < app->damage.rect_count; i++) {
+        const XRectangle * rect = &app->damage.rects[i];
+        if (XPutImage(app->display,
+                  app->window,
+                  app->gc,
+                  app->pixmap,
+                  rect->x, rect->y, rect->x, rect->y,
+                  rect->width,
+                  rect->height)) {
+
+            fprintf (stderr, "Could not draw image\n");
+            exit (1);
+        };
+    }
 }
 
-static void event_loop() {
+// Draws frames until quit, or until `until_ns` on the monotonic clock when
+// it isn't 0.
+static void event_loop(struct fps_app * app, unsigned long long until_ns) {
     XEvent exposeEvent;
     memset(&exposeEvent, 0, sizeof(exposeEvent));
     exposeEvent.type = Expose;
-    exposeEvent.xexpose.window = fps_app.window;
+    exposeEvent.xexpose.window = app->window;
 
-    while (1) {
-        while (XPending(fps_app.display) > 0) {
+    while (!should_quit && (!until_ns || monotonic_nanos() < until_ns)) {
+        while (XPending(app->display) > 0) {
             XEvent e;
-            XNextEvent (fps_app.display, & e);
+            XNextEvent (app->display, & e);
+            if (e.xany.window != app->window) continue;
+
             if (e.type == Expose) {
-                touch_fps_counter();
-                draw_screen();
+                if (!app->shm_pending) {
+                    present_produced_frame(app);
+                    update_damage(app);
+                    touch_fps_counter(app);
+                    draw_screen(app);
+                }
+            } else
+            if (app->use_shm && e.type == app->shm_completion) {
+                XShmCompletionEvent *xce = (XShmCompletionEvent *) &e;
+                if (xce->shmseg == app->frames[app->front].shm_info.shmseg) {
+                    app->shm_pending = 0;
+                }
+            } else
+            if (e.type == ClientMessage) {
+                if ((Atom) e.xclient.data.l[0] == app->delete_window) {
+                    should_quit = 1;
+                }
             } else
             if (e.type == ConfigureNotify) {
                 XConfigureEvent xce = e.xconfigure;
-                if (xce.width != fps_app.width ||
-                    xce.height != fps_app.height) {
-                    fps_app.width = xce.width;
-                    fps_app.height = xce.height;
-
-                    XDestroyImage(fps_app.pixmap);
-                    set_up_pixmap();
-                    reset_fps_counter();
+                if (xce.width != app->width ||
+                    xce.height != app->height) {
+                    // The producer reads the size, stop it before it changes.
+                    stop_producer(app);
+                    app->width = xce.width;
+                    app->height = xce.height;
+
+                    tear_down_pixmap(app);
+                    set_up_pixmap(app);
+                    start_producer(app);
+                    reset_fps_counter(app);
                 }
             }
         }
 
-        XSendEvent(fps_app.display, fps_app.window, False, ExposureMask, &exposeEvent);
-        XFlush(fps_app.display);
+        if (app->shm_pending) {
+            // Sleep until the completion (or anything else) arrives.
+            XEvent e;
+            XPeekEvent(app->display, &e);
+            continue;
+        }
+
+        XSendEvent(app->display, app->window, False, ExposureMask, &exposeEvent);
+        XFlush(app->display);
+    }
+}
+
+static xcb_atom_t intern_xcb_atom(struct fps_app * app, const char * name) {
+    xcb_intern_atom_reply_t * reply = xcb_intern_atom_reply(
+            app->xcb.connection,
+            xcb_intern_atom(app->xcb.connection, 0, strlen(name), name),
+            NULL);
+    if (!reply) {
+        fprintf (stderr, "Could not intern atom %s.\n", name);
+        exit (1);
+    }
+    xcb_atom_t atom = reply->atom;
+    free(reply);
+    return atom;
+}
+
+static void set_up_xcb_pixmap(struct fps_app * app) {
+    const xcb_setup_t * setup = xcb_get_setup(app->xcb.connection);
+    xcb_format_iterator_t it = xcb_setup_pixmap_formats_iterator(setup);
+    int scanline_pad = 0;
+
+    for (; it.rem; xcb_format_next(&it)) {
+        if (it.data->depth == app->depth) {
+            app->bits_per_pixel = it.data->bits_per_pixel;
+            scanline_pad = it.data->scanline_pad;
+            app->xcb.scanline_pad = scanline_pad;
+            break;
+        }
+    }
+    if (!scanline_pad) {
+        fprintf (stderr, "No pixmap format for depth %d.\n", app->depth);
+        exit (1);
+    }
+
+    int row_bits = app->width * app->bits_per_pixel;
+    app->stride = (row_bits + scanline_pad - 1) / scanline_pad * scanline_pad / 8;
+    app->pixmap_buffer_size = app->stride * app->height;
+
+    app->frame_count = app->producer.threads ? MAX_FRAMES : 1;
+    for (int i = 0; i < app->frame_count; i++) {
+        struct frame_buffer * frame = &app->frames[i];
+        reserve_pool(app, frame, app->pixmap_buffer_size, 0);
+        frame->image = NULL;
+        frame->buffer = frame->pool;
+    }
+    set_front_frame(app, 0);
+}
+
+// Connects and maps a window of the root depth. Returns 0 when `depth` is
+// neither 0 nor the root depth, other visuals aren't supported here.
+static int create_xcb_window(struct fps_app * app, int width, int height, int depth) {
+    int screen_number;
+    app->xcb.connection = xcb_connect(NULL, &screen_number);
+    if (xcb_connection_has_error(app->xcb.connection)) {
+        fprintf (stderr, "Could not open XCB connection.\n");
+        exit (1);
+    }
+
+    xcb_screen_iterator_t it = xcb_setup_roots_iterator(xcb_get_setup(app->xcb.connection));
+    for (; screen_number > 0 && it.rem; screen_number--) xcb_screen_next(&it);
+    app->xcb.screen = it.data;
+
+    if (depth && depth != app->xcb.screen->root_depth) {
+        xcb_disconnect(app->xcb.connection);
+        app->xcb.connection = NULL;
+        return 0;
+    }
+
+    app->width = width;
+    app->height = height;
+    app->depth = app->xcb.screen->root_depth;
+
+    // Requests are limited to this many bytes, BIG-REQUESTS included.
+    app->xcb.max_request_bytes = xcb_get_maximum_request_length(app->xcb.connection) * 4;
+
+    unsigned int values[] = {
+        app->xcb.screen->white_pixel,
+        XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_STRUCTURE_NOTIFY
+    };
+    app->xcb.window = xcb_generate_id(app->xcb.connection);
+    xcb_create_window(app->xcb.connection, XCB_COPY_FROM_PARENT, app->xcb.window,
+                      app->xcb.screen->root, 0, 0, width, height, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, app->xcb.screen->root_visual,
+                      XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK, values);
+    xcb_change_property(app->xcb.connection, XCB_PROP_MODE_REPLACE, app->xcb.window,
+                        XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, strlen("x11_fps"), "x11_fps");
+
+    xcb_atom_t protocols = intern_xcb_atom(app, "WM_PROTOCOLS");
+    app->xcb.delete_window = intern_xcb_atom(app, "WM_DELETE_WINDOW");
+    xcb_change_property(app->xcb.connection, XCB_PROP_MODE_REPLACE, app->xcb.window,
+                        protocols, XCB_ATOM_ATOM, 32, 1, &app->xcb.delete_window);
+
+    app->xcb.gc = xcb_generate_id(app->xcb.connection);
+    xcb_create_gc(app->xcb.connection, app->xcb.gc, app->xcb.window, 0, NULL);
+    xcb_map_window(app->xcb.connection, app->xcb.window);
+    xcb_flush(app->xcb.connection);
+
+    app->xcb.fence_first = 0;
+    app->xcb.fence_count = 0;
+    return 1;
+}
+
+static void destroy_xcb_window(struct fps_app * app) {
+    free(app->xcb.scratch);
+    app->xcb.scratch = NULL;
+    app->xcb.scratch_size = 0;
+    xcb_free_gc(app->xcb.connection, app->xcb.gc);
+    xcb_destroy_window(app->xcb.connection, app->xcb.window);
+    xcb_disconnect(app->xcb.connection);
+    app->xcb.connection = NULL;
+}
+
+// Waits until the server has handled the oldest frame in flight.
+static void wait_xcb_fence(struct fps_app * app) {
+    xcb_get_input_focus_reply_t * reply = xcb_get_input_focus_reply(
+            app->xcb.connection, app->xcb.fences[app->xcb.fence_first], NULL);
+    free(reply);
+    app->xcb.fence_first = (app->xcb.fence_first + 1) % MAX_IN_FLIGHT;
+    app->xcb.fence_count--;
+}
+
+// Sends `rect` of the front frame as put_image requests of as many whole
+// rows as fit the maximum request length. Rows narrower than the frame
+// are packed into the scratch buffer first. XCB copies or writes the data
+// before returning, so either buffer is free again right away.
+static void put_xcb_rect(struct fps_app * app, const XRectangle * rect) {
+    // PutImage has a 24 byte header, a BIG-REQUESTS one carries 4 more for
+    // the extended length.
+    const unsigned int header_bytes = app->xcb.max_request_bytes > 65535 * 4 ? 28 : 24;
+    int whole_rows = rect->x == 0 && rect->width == app->width;
+    int row_bytes = rect->width * app->bits_per_pixel / 8;
+    int pad = app->xcb.scanline_pad;
+    int stride = whole_rows ? app->stride : (rect->width * app->bits_per_pixel + pad - 1) / pad * pad / 8;
+    int rows = (app->xcb.max_request_bytes - header_bytes) / stride;
+    if (rows < 1) rows = 1;
+
+    for (int y = rect->y; y < rect->y + rect->height; y += rows) {
+        int count = y + rows > rect->y + rect->height ? rect->y + rect->height - y : rows;
+        const unsigned char * data = (const unsigned char *) app->pixmap_buffer + (size_t) y * app->stride;
+
+        if (!whole_rows) {
+            size_t size = (size_t) stride * count;
+            if (size > app->xcb.scratch_size) {
+                app->xcb.scratch = realloc(app->xcb.scratch, size);
+                if (!app->xcb.scratch) {
+                    fprintf (stderr, "Could not allocate scratch buffer.\n");
+                    exit (1);
+                }
+                app->xcb.scratch_size = size;
+            }
+            data += rect->x * app->bits_per_pixel / 8;
+            for (int i = 0; i < count; i++) {
+                memcpy(app->xcb.scratch + (size_t) i * stride, data + (size_t) i * app->stride, row_bytes);
+            }
+            data = app->xcb.scratch;
+        }
+
+        xcb_put_image(app->xcb.connection, XCB_IMAGE_FORMAT_Z_PIXMAP,
+                      app->xcb.window, app->xcb.gc,
+                      rect->width, count, rect->x, y, 0, app->depth,
+                      stride * count, data);
+    }
+}
+
+static void draw_xcb_screen(struct fps_app * app) {
+    for (int i = 0; i < app->damage.rect_count; i++) {
+        put_xcb_rect(app, &app->damage.rects[i]);
+    }
+
+    int slot = (app->xcb.fence_first + app->xcb.fence_count) % MAX_IN_FLIGHT;
+    app->xcb.fences[slot] = xcb_get_input_focus(app->xcb.connection);
+    app->xcb.fence_count++;
+}
+
+// Same as event_loop, but frames are pipelined: up to `in_flight` of them
+// are queued before waiting on the oldest, instead of a round trip of
+// XSendEvent and XPending per frame.
+static void event_loop_xcb(struct fps_app * app, unsigned long long until_ns) {
+    while (!should_quit && (!until_ns || monotonic_nanos() < until_ns)) {
+        xcb_generic_event_t * e;
+        while ((e = xcb_poll_for_event(app->xcb.connection))) {
+            int type = e->response_type & ~0x80;
+            if (type == XCB_CLIENT_MESSAGE) {
+                xcb_client_message_event_t * xcm = (xcb_client_message_event_t *) e;
+                if (xcm->data.data32[0] == app->xcb.delete_window) {
+                    should_quit = 1;
+                }
+            } else
+            if (type == XCB_CONFIGURE_NOTIFY) {
+                xcb_configure_notify_event_t * xce = (xcb_configure_notify_event_t *) e;
+                if (xce->width != app->width ||
+                    xce->height != app->height) {
+                    // The producer reads the size, stop it before it changes.
+                    stop_producer(app);
+                    app->width = xce->width;
+                    app->height = xce->height;
+
+                    set_up_xcb_pixmap(app);
+                    start_producer(app);
+                    reset_fps_counter(app);
+                }
+            }
+            free(e);
+        }
+        if (xcb_connection_has_error(app->xcb.connection)) {
+            fprintf (stderr, "XCB connection closed.\n");
+            exit (1);
+        }
+
+        if (app->xcb.fence_count >= app->xcb.in_flight) {
+            wait_xcb_fence(app);
+        }
+
+        present_produced_frame(app);
+        update_damage(app);
+        touch_fps_counter(app);
+        draw_xcb_screen(app);
+        xcb_flush(app->xcb.connection);
+    }
+
+    while (app->xcb.fence_count) wait_xcb_fence(app);
+}
+
+static void bench_report(struct fps_app * app, int first, const char * method, const char * client,
+                         double elapsed_s, unsigned long long produced) {
+    const struct histogram * h = &app->counter.all;
+    double fps = app->counter.frames / elapsed_s;
+    double mpixels_per_second = 1e-6 * app->counter.pixels / elapsed_s;
+    double mbytes_per_second = mpixels_per_second * app->bits_per_pixel / 8;
+    double produce_fps = produced / elapsed_s;
+
+    if (fps_bench.json) {
+        printf("%s\n  {\"width\": %d, \"height\": %d, \"depth\": %d, \"method\": \"%s\", "
+               "\"clients\": %d, \"client\": \"%s\", "
+               "\"frames\": %llu, \"fps\": %.2f, \"mbytes_per_second\": %.2f, \"mpixels_per_second\": %.2f, \"produce_fps\": %.2f, "
+               "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, "
+               "\"jitter_ms\": %.3f}",
+               first ? "" : ",",
+               app->width, app->height, app->depth, method, fps_clients.running, client,
+               app->counter.frames, fps, mbytes_per_second, mpixels_per_second, produce_fps,
+               histogram_percentile(h, 50) / 1e6, histogram_percentile(h, 90) / 1e6,
+               histogram_percentile(h, 99) / 1e6, h->max / 1e6, histogram_jitter(h) / 1e6);
+    } else {
+        printf("%d,%d,%d,%s,%d,%s,%llu,%.2f,%.2f,%.2f,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+               app->width, app->height, app->depth, method, fps_clients.running, client,
+               app->counter.frames, fps, mbytes_per_second, mpixels_per_second, produce_fps,
+               histogram_percentile(h, 50) / 1e6, histogram_percentile(h, 90) / 1e6,
+               histogram_percentile(h, 99) / 1e6, h->max / 1e6, histogram_jitter(h) / 1e6);
+    }
+    fflush(stdout);
+}
+
+// Connects and sets up the window and frames of one client. Returns 0 when
+// the server has no visual of `depth` for the method.
+static int open_client(struct fps_app * app, int method, int width, int height, int depth) {
+    app->use_shm = method == UPLOAD_SHM;
+
+    if (method == UPLOAD_XCB) {
+        // Only the XCB connection is used, not the one of the options.
+        app->display = NULL;
+        if (!create_xcb_window(app, width, height, depth)) return 0;
+        set_up_xcb_pixmap(app);
+    } else {
+        x_connect(app);
+        if (!create_window(app, width, height, depth)) return 0;
+        set_up_gc(app);
+        set_up_pixmap(app);
+    }
+    start_producer(app);
+    set_up_counter(app);
+    return 1;
+}
+
+static void close_client(struct fps_app * app, int method, int ok) {
+    if (ok) {
+        stop_producer(app);
+        if (method == UPLOAD_XCB) {
+            destroy_xcb_window(app);
+        } else {
+            tear_down_pixmap(app);
+            destroy_window(app);
+        }
+        release_pixmap(app);
+    }
+    free(app->damage.rects);
+    free(app->damage.tiles);
+    free(app->damage.marks);
+    if (app->display) XCloseDisplay(app->display);
+}
+
+static void run_client(struct fps_app * app, int method, unsigned long long until_ns) {
+    if (method == UPLOAD_XCB) {
+        event_loop_xcb(app, until_ns);
+    } else {
+        event_loop(app, until_ns);
+    }
+}
+
+// Runs one client of the benchmark. All clients warm up and start the
+// measurement together, so their uploads overlap.
+static void * bench_client_thread(void * arg) {
+    struct fps_client * client = arg;
+    struct fps_app * app = &client->app;
+
+    client->ok = open_client(app, client->method, client->width, client->height, client->depth);
+    pthread_barrier_wait(&fps_clients.barrier);
+    if (client->ok) {
+        run_client(app, client->method, monotonic_nanos() + (unsigned long long) (fps_bench.warmup * 1e9));
+        set_up_counter(app);
+    }
+    pthread_barrier_wait(&fps_clients.barrier);
+    if (client->ok) {
+        unsigned long long start_ns = monotonic_nanos();
+        run_client(app, client->method, start_ns + (unsigned long long) (fps_bench.duration * 1e9));
+        client->elapsed_s = (monotonic_nanos() - start_ns) / 1e9;
+    }
+    return NULL;
+}
+
+static void * client_thread(void * arg) {
+    struct fps_client * client = arg;
+    client->ok = open_client(&client->app, client->method, client->width, client->height, client->depth);
+    if (client->ok) run_client(&client->app, client->method, 0);
+    return NULL;
+}
+
+static void start_clients(int count, void * (*thread)(void *), int method, int width, int height, int depth) {
+    fps_clients.count = count;
+    fps_clients.clients = calloc(count, sizeof(struct fps_client));
+    if (!fps_clients.clients) {
+        fprintf (stderr, "Could not allocate clients.\n");
+        exit (1);
+    }
+    pthread_barrier_init(&fps_clients.barrier, NULL, count);
+
+    fps_clients.running = 0;
+    for (int i = 0; i < count; i++) {
+        struct fps_client * client = &fps_clients.clients[i];
+        client->app = fps_options;
+        client->app.client = i;
+        client->method = method;
+        client->width = width;
+        client->height = height;
+        client->depth = depth;
+        if (pthread_create(&client->thread, NULL, thread, client)) {
+            fprintf (stderr, "Could not start client thread.\n");
+            exit (1);
+        }
+    }
+}
+
+static void join_clients() {
+    for (int i = 0; i < fps_clients.count; i++) {
+        pthread_join(fps_clients.clients[i].thread, NULL);
+        fps_clients.running += fps_clients.clients[i].ok;
+    }
+    pthread_barrier_destroy(&fps_clients.barrier);
+}
+
+static void free_clients() {
+    free(fps_clients.clients);
+    fps_clients.clients = NULL;
+    fps_clients.count = 0;
+}
+
+// Prints a row per running client and, with several, one for all of them.
+static int report_clients(int first, int method) {
+    struct fps_app * total = calloc(1, sizeof(struct fps_app));
+    unsigned long long total_produced = 0;
+    double total_elapsed_s = 0;
+    if (!total) {
+        fprintf (stderr, "Could not allocate totals.\n");
+        exit (1);
+    }
+
+    for (int i = 0; i < fps_clients.count; i++) {
+        struct fps_client * client = &fps_clients.clients[i];
+        struct fps_app * app = &client->app;
+        char name[16];
+        if (!client->ok) continue;
+        unsigned long long produced = produced_frames(app) - app->counter.produced;
+
+        snprintf(name, sizeof(name), "%d", i);
+        bench_report(app, first, upload_method_names[method], name, client->elapsed_s, produced);
+        first = 0;
+
+        total->width = app->width;
+        total->height = app->height;
+        total->depth = app->depth;
+        total->bits_per_pixel = app->bits_per_pixel;
+        total->counter.frames += app->counter.frames;
+        total->counter.pixels += app->counter.pixels;
+        histogram_merge(&total->counter.all, &app->counter.all);
+        total_produced += produced;
+        if (client->elapsed_s > total_elapsed_s) total_elapsed_s = client->elapsed_s;
+    }
+
+    if (fps_clients.running > 1) {
+        bench_report(total, first, upload_method_names[method], "total", total_elapsed_s, total_produced);
+    }
+    free(total);
+    return first;
+}
+
+// Runs every size, depth, method and client count combination, each after
+// a warmup.
+static void run_bench() {
+    int first = 1;
+    fps_bench.quiet = 1;
+
+    if (fps_bench.json) {
+        printf("[");
+    } else {
+        printf("width,height,depth,method,clients,client,frames,fps,mbytes_per_second,mpixels_per_second,produce_fps,"
+               "p50_ms,p90_ms,p99_ms,max_ms,jitter_ms\n");
+    }
+
+    for (int s = 0; s < fps_bench.size_count && !should_quit; s++)
+    for (int d = 0; d < fps_bench.depth_count && !should_quit; d++)
+    for (int m = 0; m < fps_bench.method_count && !should_quit; m++)
+    for (int c = 0; c < fps_bench.client_count && !should_quit; c++) {
+        int method = fps_bench.methods[m];
+        if (method == UPLOAD_SHM && !fps_options.shm_available) {
+            fprintf (stderr, "Skipping shm, MIT-SHM extension is not available.\n");
+            continue;
+        }
+
+        start_clients(fps_bench.clients[c], bench_client_thread, method,
+                      fps_bench.sizes[s][0], fps_bench.sizes[s][1], fps_bench.depths[d]);
+        join_clients();
+
+        if (fps_clients.running) {
+            first = report_clients(first, method);
+        } else if (method == UPLOAD_XCB) {
+            fprintf (stderr, "Skipping depth %d for xcb, only the root depth is supported.\n", fps_bench.depths[d]);
+        } else {
+            fprintf (stderr, "Skipping depth %d, no TrueColor visual.\n", fps_bench.depths[d]);
+        }
+
+        for (int i = 0; i < fps_clients.count; i++) {
+            close_client(&fps_clients.clients[i].app, method, fps_clients.clients[i].ok);
+        }
+        free_clients();
+    }
+
+    if (fps_bench.json) printf("\n]\n");
+}
+
+static void on_signal(int signum) {
+    (void) signum;
+    should_quit = 1;
+}
+
+// Splits the comma separated `list` and calls `parse` on every item.
+static int parse_list(const char * option, const char * list, int (*parse)(const char *, int *), int * out, int stride) {
+    char item[64];
+    int count = 0;
+
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        if (len >= sizeof(item) || count == MAX_BENCH_ITEMS) {
+            fprintf (stderr, "Invalid value for `%s`.\n\n%s", option, help_message);
+            exit (1);
+        }
+        memcpy(item, list, len);
+        item[len] = 0;
+
+        if (!parse(item, out + count * stride)) {
+            fprintf (stderr, "Invalid value `%s` for `%s`.\n\n%s", item, option, help_message);
+            exit (1);
+        }
+        count++;
+        list += len;
+        if (*list == ',') list++;
+    }
+    return count;
+}
+
+static int parse_size(const char * item, int * out) {
+    return sscanf(item, "%dx%d", &out[0], &out[1]) == 2 && out[0] > 0 && out[1] > 0;
+}
+
+static int parse_rect(const char * item, int * out) {
+    int end = 0;
+    return sscanf(item, "%dx%d+%d+%d%n", &out[0], &out[1], &out[2], &out[3], &end) == 4 &&
+           !item[end] && out[0] > 0 && out[1] > 0 && out[2] >= 0 && out[3] >= 0;
+}
+
+static int parse_clients(const char * item, int * out) {
+    char * end;
+    *out = strtol(item, &end, 10);
+    return *item && !*end && *out > 0 && *out <= MAX_CLIENTS;
+}
+
+static int parse_depth(const char * item, int * out) {
+    char * end;
+    *out = strtol(item, &end, 10);
+    return *item && !*end && *out >= 0;
+}
+
+static int parse_method(const char * item, int * out) {
+    for (int i = 0; i < UPLOAD_METHOD_COUNT; i++) {
+        if (strcmp(item, upload_method_names[i]) == 0) {
+            *out = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static double parse_seconds(const char * option, const char * value) {
+    char * end;
+    double seconds = strtod(value, &end);
+    if (!*value || *end || seconds < 0) {
+        fprintf (stderr, "Invalid value `%s` for `%s`.\n\n%s", value, option, help_message);
+        exit (1);
+    }
+    return seconds;
+}
+
+static const char * option_value(int argc, char ** argv, int i) {
+    if (i + 1 >= argc) {
+        fprintf (stderr, "Option `%s` requires a value.\n\n%s", argv[i], help_message);
+        exit (1);
+    }
+    return argv[i + 1];
+}
+
+static void parse_args(struct fps_app * app, int argc, char ** argv) {
+    fps_bench.size_count = parse_list("--sizes", "640x480,1280x720,1920x1080", parse_size, &fps_bench.sizes[0][0], 2);
+    fps_bench.depth_count = parse_list("--depths", "0", parse_depth, fps_bench.depths, 1);
+    fps_bench.method_count = parse_list("--methods", "socket,shm", parse_method, fps_bench.methods, 1);
+    fps_bench.client_count = parse_list("--clients", "1", parse_clients, fps_bench.clients, 1);
+    fps_bench.duration = 5;
+    fps_bench.warmup = 1;
+    app->xcb.in_flight = 2;
+    app->damage.tile = 64;
+    app->damage.seed = 0x9e3779b9;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            printf("%s", help_message);
+            exit (0);
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            app->use_shm = 1;
+        } else if (strcmp(argv[i], "--hugepages") == 0) {
+            const char * mode = option_value(argc, argv, i);
+            if (strcmp(mode, "none") == 0) app->hugepages = HUGEPAGES_NONE;
+            else if (strcmp(mode, "thp") == 0) app->hugepages = HUGEPAGES_THP;
+            else if (strcmp(mode, "explicit") == 0) app->hugepages = HUGEPAGES_EXPLICIT;
+            else {
+                fprintf (stderr, "Invalid value `%s` for `%s`.\n\n%s", mode, argv[i], help_message);
+                exit (1);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--damage") == 0) {
+            const char * value = option_value(argc, argv, i);
+            char * end;
+            app->damage.fraction = strtod(value, &end);
+            if (!*value || *end || app->damage.fraction <= 0 || app->damage.fraction > 1) {
+                fprintf (stderr, "Invalid value `%s` for `%s`.\n\n%s", value, argv[i], help_message);
+                exit (1);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--tile") == 0) {
+            const char * value = option_value(argc, argv, i);
+            char * end;
+            app->damage.tile = strtol(value, &end, 10);
+            if (!*value || *end || app->damage.tile < 1) {
+                fprintf (stderr, "Invalid value `%s` for `%s`.\n\n%s", value, argv[i], help_message);
+                exit (1);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--merge") == 0) {
+            app->damage.merge = 1;
+        } else if (strcmp(argv[i], "--rects") == 0) {
+            app->damage.fixed_count = parse_list(argv[i], option_value(argc, argv, i), parse_rect, &app->damage.fixed[0][0], 4);
+            i++;
+        } else if (strcmp(argv[i], "--xcb") == 0) {
+            app->xcb.enabled = 1;
+        } else if (strcmp(argv[i], "--in-flight") == 0) {
+            const char * value = option_value(argc, argv, i);
+            char * end;
+            app->xcb.in_flight = strtol(value, &end, 10);
+            if (!*value || *end || app->xcb.in_flight < 1 || app->xcb.in_flight > MAX_IN_FLIGHT) {
+                fprintf (stderr, "Invalid value `%s` for `%s`.\n\n%s", value, argv[i], help_message);
+                exit (1);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--produce") == 0) {
+            const char * value = option_value(argc, argv, i);
+            char * end;
+            app->producer.threads = strtol(value, &end, 10);
+            if (!*value || *end || app->producer.threads < 1 || app->producer.threads > MAX_PRODUCER_THREADS) {
+                fprintf (stderr, "Invalid value `%s` for `%s`.\n\n%s", value, argv[i], help_message);
+                exit (1);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            fps_bench.enabled = 1;
+        } else if (strcmp(argv[i], "--sizes") == 0) {
+            fps_bench.size_count = parse_list(argv[i], option_value(argc, argv, i), parse_size, &fps_bench.sizes[0][0], 2);
+            i++;
+        } else if (strcmp(argv[i], "--depths") == 0) {
+            fps_bench.depth_count = parse_list(argv[i], option_value(argc, argv, i), parse_depth, fps_bench.depths, 1);
+            i++;
+        } else if (strcmp(argv[i], "--methods") == 0) {
+            fps_bench.method_count = parse_list(argv[i], option_value(argc, argv, i), parse_method, fps_bench.methods, 1);
+            i++;
+        } else if (strcmp(argv[i], "--clients") == 0) {
+            fps_bench.client_count = parse_list(argv[i], option_value(argc, argv, i), parse_clients, fps_bench.clients, 1);
+            i++;
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            fps_bench.duration = parse_seconds(argv[i], option_value(argc, argv, i));
+            if (fps_bench.duration == 0) {
+                fprintf (stderr, "Invalid value `%s` for `%s`.\n\n%s", argv[i + 1], argv[i], help_message);
+                exit (1);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--warmup") == 0) {
+            fps_bench.warmup = parse_seconds(argv[i], option_value(argc, argv, i));
+            i++;
+        } else if (strcmp(argv[i], "--format") == 0) {
+            const char * format = option_value(argc, argv, i);
+            if (strcmp(format, "json") == 0) fps_bench.json = 1;
+            else if (strcmp(format, "csv") == 0) fps_bench.json = 0;
+            else {
+                fprintf (stderr, "Invalid value `%s` for `%s`.\n\n%s", format, argv[i], help_message);
+                exit (1);
+            }
+            i++;
+        } else {
+            fprintf (stderr, "Unknown option `%s`.\n\n%s", argv[i], help_message);
+            exit (1);
+        }
+    }
+
+    if (app->xcb.enabled && app->use_shm) {
+        fprintf (stderr, "`--xcb` and `--shm` can't be combined.\n\n%s", help_message);
+        exit (1);
     }
 }
 
 int main (int argc, char ** argv) {
-    x_connect();
-    create_window();
-    set_up_gc();
-    set_up_pixmap();
-    set_up_counter();
-    event_loop();
+    parse_args(&fps_options, argc, argv);
+    XInitThreads();
+    // Only to find out what the server supports, every client connects
+    // on its own.
+    x_connect(&fps_options);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    if (fps_bench.enabled) {
+        run_bench();
+        XCloseDisplay(fps_options.display);
+        return 0;
+    }
+
+    int method = fps_options.xcb.enabled ? UPLOAD_XCB : fps_options.use_shm ? UPLOAD_SHM : UPLOAD_SOCKET;
+    start_clients(fps_bench.clients[0], client_thread, method, 400, 300, 0);
+    join_clients();
+
+    struct histogram * all = calloc(1, sizeof(struct histogram));
+    for (int i = 0; i < fps_clients.count; i++) {
+        struct fps_app * app = &fps_clients.clients[i].app;
+        if (fps_clients.clients[i].ok) histogram_merge(all, &app->counter.all);
+        close_client(app, method, fps_clients.clients[i].ok);
+    }
+    free_clients();
+    XCloseDisplay(fps_options.display);
+
+    histogram_dump(all);
+    free(all);
     return 0;
 }